@@ -0,0 +1,678 @@
+#include "boardCodec.h"
+#include "bookIndex.h"
+#include "bookTraversal.h"
+#include "redis.h"
+#include "searchResult.h"
+#include "syntheticBook.h"
+#include "osl/move_generator/legalMoves.h"
+#include "osl/record/compactBoard.h"
+#include "osl/record/record.h"
+#include "osl/state/numEffectState.h"
+#include <glog/logging.h>
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/time.h>
+
+/**
+ * Microbenchmarks of the hot paths of master, client and histogram: the
+ * codecs of boardCodec.h and the stream versions they replace, the keys of
+ * boards, the records and replies of search results, and the traversal of
+ * a synthetic book read directly and through its index.
+ * The codecs are checked before they are measured.  Each benchmark runs
+ * --rounds times and the fastest round is reported.  With --format tsv,
+ * the output of two builds can be compared by diff or paste.
+ */
+
+/**
+ * Global variables
+ */
+
+namespace bp = boost::program_options;
+bp::variables_map vm;
+
+int positions = 10000;
+int max_plies = 80;
+int repeat = 20;
+int rounds = 3;
+unsigned int seed = 1;
+int threads = 4;
+std::string format = "text";
+std::string filter;
+std::string book_file = "bench.dat";
+SyntheticBookConfig book_config;
+
+/** random positions and the moves leading to them */
+std::vector<osl::record::CompactBoard> boards;
+std::vector<osl::SimpleState> states;
+std::vector<moves_t> paths;
+std::vector<std::string> keys, moves_strs, records;
+std::vector<SearchResult> results;
+std::vector<redisReplyPtr> replies;
+
+boost::scoped_ptr<WeightedBookSource> weighted_book;
+boost::scoped_ptr<BookIndex> book_index;
+
+size_t sink = 0; // keeps the loops from being optimized away
+
+/**
+ * Stream versions
+ */
+
+const std::string streamEncodeBoard(const osl::record::CompactBoard& cb)
+{
+  std::ostringstream ss;
+  ss << cb;
+  return ss.str();
+}
+
+void streamDecodeBoard(const std::string& str, osl::record::CompactBoard& cb)
+{
+  std::istringstream in(str);
+  in >> cb;
+}
+
+const std::string streamEncodeMoves(const moves_t& moves)
+{
+  std::ostringstream ss;
+  for (size_t i=0; i<moves.size(); ++i) {
+    osl::record::writeInt(ss, moves[i].intValue());
+  }
+  return ss.str();
+}
+
+void streamDecodeMoves(const std::string& binary, moves_t& moves)
+{
+  std::stringstream ss(binary);
+  const int size = binary.size() / 4;
+  for (int i=0; i<size; ++i) {
+    moves.push_back(osl::Move::makeDirect(osl::record::readInt(ss)));
+  }
+}
+
+/**
+ * Replies of HGETALL made in memory, so that parseSearchResultReply() is
+ * measured without a server.
+ */
+
+struct FakeHash
+{
+  std::vector<std::string> strings;  // fields and values
+  std::vector<redisReply> elements;
+  std::vector<redisReply*> pointers;
+  redisReply array;
+};
+
+struct FakeHashDeleter
+{
+  FakeHash *hash;
+
+  explicit FakeHashDeleter(FakeHash *_hash) : hash(_hash) {}
+  void operator()(redisReply *) const { delete hash; }
+};
+
+redisReplyPtr makeFakeHash(const std::vector<std::string>& strings)
+{
+  FakeHash *hash = new FakeHash;
+  hash->strings = strings;
+  hash->elements.resize(strings.size());
+  for (size_t i=0; i<strings.size(); ++i) {
+    redisReply& r = hash->elements[i];
+    memset(&r, 0, sizeof(r));
+    r.type = REDIS_REPLY_STRING;
+    r.str  = const_cast<char*>(hash->strings[i].data());
+    r.len  = hash->strings[i].size();
+    hash->pointers.push_back(&r);
+  }
+  memset(&hash->array, 0, sizeof(hash->array));
+  hash->array.type     = REDIS_REPLY_ARRAY;
+  hash->array.elements = hash->pointers.size();
+  hash->array.element  = hash->pointers.empty() ? NULL : &*hash->pointers.begin();
+  return redisReplyPtr(&hash->array, FakeHashDeleter(hash));
+}
+
+/**
+ * Functions
+ */
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/**
+ * Play random legal moves from the initial position, and make the keys,
+ * records and replies of the positions.
+ */
+void makePositions()
+{
+  srand(seed);
+  for (int i=0; i<positions; ++i) {
+    osl::NumEffectState state((osl::SimpleState(osl::HIRATE)));
+    moves_t path;
+    const int plies = rand() % (max_plies + 1);
+    for (int j=0; j<plies; ++j) {
+      osl::MoveVector moves;
+      osl::LegalMoves::generate(state, moves);
+      if (moves.empty())
+        break;
+      const osl::Move move = moves[rand() % moves.size()];
+      state.makeMove(move);
+      path.push_back(move);
+    }
+    boards.push_back(osl::record::CompactBoard(state));
+    states.push_back(state);
+    paths.push_back(path);
+    keys.push_back(streamEncodeBoard(boards.back()));
+    moves_strs.push_back(streamEncodeMoves(path));
+
+    SearchResult sr(i);
+    sr.board            = boards.back();
+    sr.depth            = 1 + rand() % 2000;
+    sr.score            = rand() % 2001 - 1000;
+    sr.consumed_seconds = rand() % 600;
+    sr.pv_moves         = path;  // any moves serve to measure
+    sr.moves            = path;
+    results.push_back(sr);
+    records.push_back(encodeSearchResult(sr));
+
+    std::vector<std::string> hash;
+    hash.push_back("board");    hash.push_back(keys.back());
+    hash.push_back("moves");    hash.push_back(moves_strs.back());
+    hash.push_back("mirrored"); hash.push_back("0");
+    hash.push_back("result");   hash.push_back(records.back());
+    replies.push_back(makeFakeHash(hash));
+  }
+}
+
+/**
+ * @return the number of mismatches
+ */
+int verify()
+{
+  int errors = 0;
+  char buf[COMPACT_BOARD_SIZE];
+  for (size_t i=0; i<boards.size(); ++i) {
+    const std::string& expected = keys[i];
+    encodeCompactBoard(boards[i], buf);
+    if (expected != std::string(buf, sizeof(buf))
+        || compactBoardToString(boards[i]) != expected) {
+      std::cerr << "encodeCompactBoard differs at " << i << std::endl;
+      ++errors;
+      continue;
+    }
+
+    osl::record::CompactBoard cb;
+    if (decodeCompactBoard(buf, sizeof(buf), cb) || !(cb == boards[i])) {
+      std::cerr << "decodeCompactBoard differs at " << i << std::endl;
+      ++errors;
+    }
+    osl::SimpleState state;
+    if (decodeCompactBoard(buf, sizeof(buf), state)
+        || streamEncodeBoard(osl::record::CompactBoard(state)) != expected) {
+      std::cerr << "decodeCompactBoard to a state differs at " << i << std::endl;
+      ++errors;
+    }
+
+    if (encodeMoves(paths[i]) != moves_strs[i]) {
+      std::cerr << "encodeMoves differs at " << i << std::endl;
+      ++errors;
+    }
+    moves_t moves;
+    decodeMoves(moves_strs[i].data(), moves_strs[i].size(), moves);
+    if (!(moves == paths[i])) {
+      std::cerr << "decodeMoves differs at " << i << std::endl;
+      ++errors;
+    }
+
+    SearchResult sr(i);
+    if (parseSearchResultReply(replies[i], sr)
+        || sr.depth != results[i].depth || sr.score != results[i].score
+        || !(sr.pv_moves == paths[i]) || !(sr.moves == paths[i])
+        || !(sr.board == boards[i])) {
+      std::cerr << "parseSearchResultReply differs at " << i << std::endl;
+      ++errors;
+    }
+  }
+  return errors;
+}
+
+/**
+ * Benchmarks.  Each returns the number of operations done.
+ */
+
+size_t encodeBoardStream()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<boards.size(); ++i)
+      sink += streamEncodeBoard(boards[i])[i % COMPACT_BOARD_SIZE];
+  return boards.size() * repeat;
+}
+
+size_t encodeBoardBuffer()
+{
+  char buf[COMPACT_BOARD_SIZE];
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<boards.size(); ++i) {
+      encodeCompactBoard(boards[i], buf);
+      sink += buf[i % COMPACT_BOARD_SIZE];
+    }
+  return boards.size() * repeat;
+}
+
+size_t decodeBoardStream()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<keys.size(); ++i) {
+      osl::record::CompactBoard cb;
+      streamDecodeBoard(keys[i], cb);
+      sink += cb.turn();
+    }
+  return keys.size() * repeat;
+}
+
+size_t decodeBoardBuffer()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<keys.size(); ++i) {
+      osl::record::CompactBoard cb;
+      decodeCompactBoard(keys[i].data(), keys[i].size(), cb);
+      sink += cb.turn();
+    }
+  return keys.size() * repeat;
+}
+
+size_t decodeStateStream()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<keys.size(); ++i) {
+      osl::record::CompactBoard cb;
+      streamDecodeBoard(keys[i], cb);
+      sink += cb.getState().turn();
+    }
+  return keys.size() * repeat;
+}
+
+size_t decodeStateBuffer()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<keys.size(); ++i) {
+      osl::SimpleState state;
+      decodeCompactBoard(keys[i].data(), keys[i].size(), state);
+      sink += state.turn();
+    }
+  return keys.size() * repeat;
+}
+
+size_t encodeMovesStream()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<paths.size(); ++i)
+      sink += streamEncodeMoves(paths[i]).size();
+  return paths.size() * repeat;
+}
+
+size_t encodeMovesBuffer()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<paths.size(); ++i)
+      sink += encodeMoves(paths[i]).size();
+  return paths.size() * repeat;
+}
+
+size_t decodeMovesStream()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<moves_strs.size(); ++i) {
+      moves_t moves;
+      streamDecodeMoves(moves_strs[i], moves);
+      sink += moves.size();
+    }
+  return moves_strs.size() * repeat;
+}
+
+size_t decodeMovesBuffer()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<moves_strs.size(); ++i) {
+      moves_t moves;
+      decodeMoves(moves_strs[i].data(), moves_strs[i].size(), moves);
+      sink += moves.size();
+    }
+  return moves_strs.size() * repeat;
+}
+
+size_t movesToCsa()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<paths.size(); ++i)
+      sink += movesToCsaString(paths[i]).size();
+  return paths.size() * repeat;
+}
+
+size_t keyOfBoard()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<boards.size(); ++i)
+      sink += compactBoardToString(boards[i])[i % COMPACT_BOARD_SIZE];
+  return boards.size() * repeat;
+}
+
+size_t hashOfKey()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<keys.size(); ++i)
+      sink += compactBoardHash(keys[i]);
+  return keys.size() * repeat;
+}
+
+size_t canonicalKey()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<states.size(); ++i) {
+      bool mirrored;
+      sink += canonicalBoardString(states[i], mirrored)[i % COMPACT_BOARD_SIZE] + mirrored;
+    }
+  return states.size() * repeat;
+}
+
+size_t encodeResult()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<results.size(); ++i)
+      sink += encodeSearchResult(results[i]).size();
+  return results.size() * repeat;
+}
+
+size_t decodeResult()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<records.size(); ++i) {
+      SearchResult sr(i);
+      decodeSearchResult(records[i].data(), records[i].size(), sr);
+      sink += sr.depth;
+    }
+  return records.size() * repeat;
+}
+
+size_t parseReply()
+{
+  for (int r=0; r<repeat; ++r)
+    for (size_t i=0; i<replies.size(); ++i) {
+      SearchResult sr(i);
+      parseSearchResultReply(replies[i], sr);
+      sink += sr.depth + sr.moves.size();
+    }
+  return replies.size() * repeat;
+}
+
+/**
+ * Visit states of the book in the order of their indices, as many as the
+ * positions.
+ */
+size_t stateKeys(BookSource& book)
+{
+  const int n = std::min(book.getTotalState(), positions);
+  for (int i=0; i<n; ++i)
+    sink += book.getStateKey(i)[i % COMPACT_BOARD_SIZE];
+  return n;
+}
+
+size_t stateKeysOfBook()  { return stateKeys(*weighted_book); }
+size_t stateKeysOfIndex() { return stateKeys(*book_index); }
+
+size_t stateMoves(BookSource& book)
+{
+  const int n = std::min(book.getTotalState(), positions);
+  edges_t moves;
+  for (int i=0; i<n; ++i) {
+    book.getMoves(i, moves);
+    sink += moves.size();
+  }
+  return n;
+}
+
+size_t stateMovesOfBook()  { return stateMoves(*weighted_book); }
+size_t stateMovesOfIndex() { return stateMoves(*book_index); }
+
+/**
+ * Does what master does with a position except writing it.
+ */
+class CountingSink : public PositionSink
+{
+public:
+  void append(const std::string& state_key, const moves_t& moves, double reach) {
+    sink += state_key[moves.size() % COMPACT_BOARD_SIZE]
+      + encodeMoves(moves).size() + (reach > 0.5);
+  }
+};
+
+/**
+ * @return the number of positions appended
+ */
+size_t traverse(const std::vector<BookSource*>& books)
+{
+  TraversalConfig config;
+  std::vector<CountingSink> counting_sinks(books.size());
+  std::vector<PositionSink*> sinks;
+  for (size_t i=0; i<books.size(); ++i)
+    sinks.push_back(&counting_sinks[i]);
+  return traverseBook(books, config, sinks);
+}
+
+size_t traverseBookFile()
+{
+  return traverse(std::vector<BookSource*>(1, weighted_book.get()));
+}
+
+size_t traverseIndex()
+{
+  return traverse(std::vector<BookSource*>(1, book_index.get()));
+}
+
+size_t traverseIndexThreads()
+{
+  // the index is shared among threads as in master
+  return traverse(std::vector<BookSource*>(std::max(threads, 1), book_index.get()));
+}
+
+struct Benchmark
+{
+  const char *name;
+  size_t (*run)();
+  bool book;           // needs the synthetic book
+};
+
+const Benchmark benchmarks[] = {
+  { "board.encode.stream",    encodeBoardStream,    false },
+  { "board.encode.buffer",    encodeBoardBuffer,    false },
+  { "board.decode.stream",    decodeBoardStream,    false },
+  { "board.decode.buffer",    decodeBoardBuffer,    false },
+  { "state.decode.stream",    decodeStateStream,    false },
+  { "state.decode.buffer",    decodeStateBuffer,    false },
+  { "moves.encode.stream",    encodeMovesStream,    false },
+  { "moves.encode.buffer",    encodeMovesBuffer,    false },
+  { "moves.decode.stream",    decodeMovesStream,    false },
+  { "moves.decode.buffer",    decodeMovesBuffer,    false },
+  { "moves.csa",              movesToCsa,           false },
+  { "key.compactBoardToString", keyOfBoard,         false },
+  { "key.compactBoardHash",   hashOfKey,            false },
+  { "key.canonicalBoardString", canonicalKey,       false },
+  { "result.encode",          encodeResult,         false },
+  { "result.decode",          decodeResult,         false },
+  { "result.parseReply",      parseReply,           false },
+  { "book.getStateKey.book",  stateKeysOfBook,      true },
+  { "book.getStateKey.index", stateKeysOfIndex,     true },
+  { "book.getMoves.book",     stateMovesOfBook,     true },
+  { "book.getMoves.index",    stateMovesOfIndex,    true },
+  { "traverse.book",          traverseBookFile,     true },
+  { "traverse.index",         traverseIndex,        true },
+  { "traverse.index.threads", traverseIndexThreads, true },
+};
+
+bool selected(const Benchmark& benchmark)
+{
+  return filter.empty() || std::string(benchmark.name).find(filter) != std::string::npos;
+}
+
+/**
+ * Generate the book and its index if a selected benchmark needs them.
+ * @return 0 on success
+ */
+int openBook()
+{
+  bool needed = false;
+  for (size_t i=0; i<sizeof(benchmarks)/sizeof(benchmarks[0]); ++i)
+    needed |= benchmarks[i].book && selected(benchmarks[i]);
+  if (!needed)
+    return 0;
+
+  const std::string index_file = book_file + ".idx";
+  if (writeSyntheticBook(book_file, book_config)
+      || buildBookIndex(book_file, index_file))
+    return 1;
+  book_index.reset(new BookIndex);
+  if (book_index->open(index_file, book_file))
+    return 1;
+  weighted_book.reset(new WeightedBookSource(book_file));
+  return 0;
+}
+
+/**
+ * Run the selected benchmarks and print the fastest rounds.
+ */
+void measure()
+{
+  const bool tsv = (format == "tsv");
+  if (tsv) {
+    std::cout << boost::format("# positions=%d max-plies=%d repeat=%d rounds=%d seed=%u"
+                               " book-states=%d book-branching=%d threads=%d\n")
+      % positions % max_plies % repeat % rounds % seed
+      % book_config.states % book_config.branching % threads;
+    std::cout << "benchmark\tops\tseconds\tns_per_op" << std::endl;
+  }
+
+  for (size_t i=0; i<sizeof(benchmarks)/sizeof(benchmarks[0]); ++i) {
+    const Benchmark& benchmark = benchmarks[i];
+    if (!selected(benchmark))
+      continue;
+    size_t ops = 0;
+    double best = 0.0;
+    for (int r=0; r<rounds; ++r) {
+      const double start = now();
+      ops = benchmark.run();
+      const double seconds = now() - start;
+      if (r == 0 || seconds < best)
+        best = seconds;
+    }
+    const double ns = ops ? best * 1e9 / ops : 0.0;
+    if (tsv)
+      std::cout << boost::format("%s\t%u\t%.6f\t%.1f") % benchmark.name % ops % best % ns
+                << std::endl;
+    else
+      std::cout << boost::format("%-28s %12.1f ns/op %12u ops") % benchmark.name % ns % ops
+                << std::endl;
+  }
+
+  if (sink == 0)
+    std::cout << std::endl;
+}
+
+void printUsage(std::ostream& out,
+                char **argv,
+                const boost::program_options::options_description& command_line_options)
+{
+  out <<
+    "Usage: " << argv[0] << " [options]\n"
+      << command_line_options
+      << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  /* Set up logging */
+  FLAGS_log_dir = ".";
+  google::InitGoogleLogging(argv[0]);
+
+  /* Parse command line options */
+  bp::options_description command_line_options;
+  command_line_options.add_options()
+    ("positions", bp::value<int>(&positions)->default_value(positions),
+     "number of random positions, and of book states visited by book.*")
+    ("max-plies", bp::value<int>(&max_plies)->default_value(max_plies),
+     "plies played at most from the initial position")
+    ("repeat", bp::value<int>(&repeat)->default_value(repeat),
+     "times each position is processed in a round")
+    ("rounds", bp::value<int>(&rounds)->default_value(rounds),
+     "times each benchmark is run.  the fastest is reported")
+    ("seed", bp::value<unsigned int>(&seed)->default_value(seed),
+     "seed of the random positions and of the synthetic book")
+    ("book-file", bp::value<std::string>(&book_file)->default_value(book_file),
+     "file to write the synthetic book to.  its index is written to <book-file>.idx")
+    ("book-states", bp::value<int>(&book_config.states)->default_value(book_config.states),
+     "states of the synthetic book")
+    ("book-branching", bp::value<int>(&book_config.branching)->default_value(book_config.branching),
+     "moves from a state of the synthetic book at most")
+    ("threads", bp::value<int>(&threads)->default_value(threads),
+     "threads of traverse.index.threads")
+    ("format", bp::value<std::string>(&format)->default_value(format),
+     "text, or tsv to compare builds")
+    ("filter", bp::value<std::string>(&filter)->default_value(filter),
+     "run only benchmarks whose names contain this string")
+    ("help,h", "show this help message.");
+  bp::positional_options_description p;
+
+  try {
+    bp::store(
+      bp::command_line_parser(
+	argc, argv).options(command_line_options).positional(p).run(), vm);
+    bp::notify(vm);
+    if (vm.count("help")) {
+      printUsage(std::cout, argv, command_line_options);
+      return 0;
+    }
+  } catch (std::exception &e) {
+    std::cerr << "error in parsing options\n"
+	      << e.what() << std::endl;
+    printUsage(std::cerr, argv, command_line_options);
+    return 1;
+  }
+  if (format != "text" && format != "tsv") {
+    printUsage(std::cerr, argv, command_line_options);
+    return 1;
+  }
+  repeat = std::max(repeat, 1);
+  rounds = std::max(rounds, 1);
+  book_config.seed = seed;
+
+  makePositions();
+  const int errors = verify();
+  if (errors) {
+    std::cerr << "Mismatches: " << errors << std::endl;
+    return 1;
+  }
+  std::cerr << "Verified positions: " << boards.size() << std::endl;
+
+  if (openBook()) {
+    std::cerr << "Failed to prepare the book " << book_file << std::endl;
+    return 1;
+  }
+
+  measure();
+  return 0;
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
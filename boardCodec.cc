@@ -0,0 +1,86 @@
+#include "boardCodec.h"
+#include <cassert>
+
+namespace
+{
+  inline void writeInt32(char *p, int value)
+  {
+    const unsigned int u = static_cast<unsigned int>(value);
+    p[0] = static_cast<char>((u >> 24) & 0xff);
+    p[1] = static_cast<char>((u >> 16) & 0xff);
+    p[2] = static_cast<char>((u >> 8) & 0xff);
+    p[3] = static_cast<char>(u & 0xff);
+  }
+
+  inline int readInt32(const char *p)
+  {
+    const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<int>((unsigned int)u[0] << 24 | (unsigned int)u[1] << 16
+                            | (unsigned int)u[2] << 8 | u[3]);
+  }
+} // anonymous namespace
+
+void encodeCompactBoard(const osl::record::CompactBoard& cb, char *buf)
+{
+  const std::vector<osl::record::OPiece>& pieces = cb.getPieces();
+  assert(pieces.size() == 40);
+  for (size_t i=0; i<pieces.size(); ++i, buf+=4) {
+    writeInt32(buf, static_cast<int>(pieces[i]));
+  }
+  writeInt32(buf, static_cast<int>(cb.turn()));
+}
+
+int decodeCompactBoard(const char *buf, size_t len, osl::SimpleState& state)
+{
+  if (len != COMPACT_BOARD_SIZE)
+    return 1;
+  state = osl::SimpleState();
+  state.init();
+  for (int i=0; i<40; ++i, buf+=4) {
+    const osl::record::OPiece piece(readInt32(buf));
+    state.setPiece(piece.getOwner(), piece.getSquare(), piece.getPtype());
+  }
+  state.setTurn(static_cast<osl::Player>(readInt32(buf)));
+  state.initPawnMask();
+  return 0;
+}
+
+int decodeCompactBoard(const char *buf, size_t len, osl::record::CompactBoard& cb)
+{
+  if (len != COMPACT_BOARD_SIZE)
+    return 1;
+  /* CompactBoard has no setters; its pieces are sorted the same way again */
+  osl::SimpleState state;
+  decodeCompactBoard(buf, len, state);
+  cb = osl::record::CompactBoard(state);
+  return 0;
+}
+
+size_t encodeMoves(const moves_t& moves, char *buf)
+{
+  for (size_t i=0; i<moves.size(); ++i, buf+=4) {
+    writeInt32(buf, moves[i].intValue());
+  }
+  return moves.size() * 4;
+}
+
+const std::string encodeMoves(const moves_t& moves)
+{
+  std::string ret(moves.size() * 4, '\0');
+  if (!moves.empty())
+    encodeMoves(moves, &ret[0]);
+  return ret;
+}
+
+void decodeMoves(const char *buf, size_t len, moves_t& moves)
+{
+  const size_t size = len / 4;
+  moves.reserve(moves.size() + size);
+  for (size_t i=0; i<size; ++i, buf+=4) {
+    moves.push_back(osl::Move::makeDirect(readInt32(buf)));
+  }
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
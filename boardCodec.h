@@ -0,0 +1,53 @@
+#ifndef _GPS_BOARD_CODEC_H
+#define _GPS_BOARD_CODEC_H
+
+#include "osl/record/compactBoard.h"
+#include "osl/stl/vector.h"
+#include <string>
+
+/**
+ * Encoders and decoders working on caller-provided buffers, producing the
+ * same bytes as the stream operators of CompactBoard and
+ * osl::record::writeInt(): 32-bit integers in big endian.
+ * bench.cc checks that they agree with the stream versions.
+ */
+typedef osl::stl::vector<osl::Move> moves_t;
+
+/** 40 pieces and the turn */
+const size_t COMPACT_BOARD_SIZE = 41*4;
+
+/**
+ * @param buf COMPACT_BOARD_SIZE bytes
+ */
+void encodeCompactBoard(const osl::record::CompactBoard& cb, char *buf);
+
+/**
+ * Decode a board directly into a state, as CompactBoard::getState() does.
+ * @return 0 on success, 1 if len is wrong
+ */
+int decodeCompactBoard(const char *buf, size_t len, osl::SimpleState& state);
+
+/**
+ * Decode a board straight from the bytes, as the SimpleState overload
+ * does, without copying them into a string or a stream.
+ * @return 0 on success, 1 if len is wrong
+ */
+int decodeCompactBoard(const char *buf, size_t len, osl::record::CompactBoard& cb);
+
+/**
+ * @param buf 4 bytes per move
+ * @return bytes written
+ */
+size_t encodeMoves(const moves_t& moves, char *buf);
+const std::string encodeMoves(const moves_t& moves);
+
+/**
+ * Append the moves in buf to moves.
+ */
+void decodeMoves(const char *buf, size_t len, moves_t& moves);
+
+#endif /* _GPS_BOARD_CODEC_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
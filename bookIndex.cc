@@ -0,0 +1,177 @@
+#include "bookIndex.h"
+#include "searchResult.h"
+#include "osl/hash/hashKey.h"
+#include "osl/record/compactBoard.h"
+#include "osl/record/opening/openingBook.h"
+#include "osl/state/simpleState.h"
+#include <glog/logging.h>
+#include <boost/foreach.hpp>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+#include <cassert>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace
+{
+  const char BOOK_INDEX_MAGIC[8] = "GPSBIDX";
+}
+
+int buildBookIndex(const std::string& book_file, const std::string& index_file)
+{
+  struct stat st;
+  if (stat(book_file.c_str(), &st) != 0) {
+    LOG(ERROR) << "Failed to stat " << book_file;
+    return 1;
+  }
+
+  osl::record::opening::WeightedBook book(book_file.c_str());
+  std::ofstream out(index_file.c_str(), std::ios_base::binary | std::ios_base::trunc);
+  if (!out) {
+    LOG(ERROR) << "Failed to open " << index_file;
+    return 1;
+  }
+
+  BookIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BOOK_INDEX_MAGIC, sizeof(header.magic));
+  header.version      = BOOK_INDEX_VERSION;
+  header.total_states = book.getTotalState();
+  header.start_state  = book.getStartState();
+  header.book_size    = st.st_size;
+  header.book_mtime   = st.st_mtime;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  std::vector<BookIndexEdge> edges;
+  for (int i=0; i<book.getTotalState(); ++i) {
+    const osl::SimpleState state(book.getBoard(i));
+    const std::string key = compactBoardToString(osl::record::CompactBoard(state));
+
+    BookIndexState s;
+    memset(&s, 0, sizeof(s));
+    assert(key.size() == sizeof(s.key));
+    s.hash = compactBoardHash(key);
+    memcpy(s.key, key.data(), sizeof(s.key));
+    s.turn = state.turn();
+    s.first_edge = edges.size();
+
+    std::vector<osl::record::opening::WMove> moves = book.getMoves(i);
+    std::sort(moves.begin(), moves.end(), osl::record::opening::WMoveSort());
+    const osl::hash::HashKey hash(state);
+    BOOST_FOREACH(const osl::record::opening::WMove& move, moves) {
+      // consistancy check
+      const osl::hash::HashKey next_hash(book.getBoard(move.getStateIndex()));
+      if (hash.newMakeMove(move.getMove()) != next_hash) {
+        LOG(ERROR) << "Illegal move found at state " << i;
+        return 1;
+      }
+      BookIndexEdge edge;
+      edge.move       = move.getMove().intValue();
+      edge.weight     = move.getWeight();
+      edge.next_state = move.getStateIndex();
+      edges.push_back(edge);
+    }
+    s.edges = edges.size() - s.first_edge;
+    out.write(reinterpret_cast<const char*>(&s), sizeof(s));
+
+    if (i % 100000 == 0)
+      LOG(INFO) << "Indexed states: " << i;
+  }
+
+  if (!edges.empty())
+    out.write(reinterpret_cast<const char*>(&*edges.begin()),
+              sizeof(BookIndexEdge) * edges.size());
+  header.total_edges = edges.size();
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.close();
+  if (!out) {
+    LOG(ERROR) << "Failed to write " << index_file;
+    return 1;
+  }
+
+  LOG(INFO) << "Indexed " << header.total_states << " states and "
+            << header.total_edges << " moves";
+  return 0;
+}
+
+
+BookIndex::BookIndex()
+  : address(MAP_FAILED), length(0), header(NULL), states(NULL), edges(NULL)
+{
+}
+
+BookIndex::~BookIndex()
+{
+  if (address != MAP_FAILED)
+    munmap(address, length);
+}
+
+int BookIndex::open(const std::string& index_file, const std::string& book_file)
+{
+  assert(address == MAP_FAILED);
+  const int fd = ::open(index_file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to open " << index_file;
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BookIndexHeader)) {
+    LOG(ERROR) << "Invalid index file: " << index_file;
+    close(fd);
+    return 1;
+  }
+  length = st.st_size;
+  address = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map " << index_file;
+    return 1;
+  }
+
+  header = static_cast<const BookIndexHeader*>(address);
+  if (memcmp(header->magic, BOOK_INDEX_MAGIC, sizeof(header->magic)) != 0
+      || header->version != BOOK_INDEX_VERSION) {
+    LOG(ERROR) << "Unknown index format: " << index_file;
+    return 1;
+  }
+  const size_t expected = sizeof(BookIndexHeader)
+    + sizeof(BookIndexState) * header->total_states
+    + sizeof(BookIndexEdge) * header->total_edges;
+  if (length != expected) {
+    LOG(ERROR) << "Broken index file: " << index_file;
+    return 1;
+  }
+  states = reinterpret_cast<const BookIndexState*>(header + 1);
+  edges  = reinterpret_cast<const BookIndexEdge*>(states + header->total_states);
+
+  if (!book_file.empty()) {
+    if (stat(book_file.c_str(), &st) != 0
+        || (uint64_t)st.st_size != header->book_size
+        || (int64_t)st.st_mtime != header->book_mtime) {
+      LOG(WARNING) << index_file << " is out of date with " << book_file;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void BookIndex::getMoves(int state_index, edges_t& moves)
+{
+  const BookIndexState& s = states[state_index];
+  moves.clear();
+  for (uint32_t i=s.first_edge; i<s.first_edge+s.edges; ++i) {
+    const BookIndexEdge& e = edges[i];
+    moves.push_back(BookEdge(osl::Move::makeDirect(e.move), e.weight, e.next_state));
+  }
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -0,0 +1,93 @@
+#ifndef _GPS_BOOK_INDEX_H
+#define _GPS_BOOK_INDEX_H
+
+#include "bookTraversal.h"
+#include <string>
+#include <stdint.h>
+
+/**
+ * A binary index of a WeightedBook, built once by buildIndex and mapped by
+ * master.  The file consists of a header, the states ordered by their
+ * indices and the edges of all the states, in native byte order.
+ */
+struct BookIndexHeader
+{
+  char magic[8];          // "GPSBIDX"
+  uint32_t version;
+  uint32_t total_states;
+  uint32_t start_state;
+  uint32_t total_edges;
+  uint64_t book_size;     // size of the book the index was built from
+  int64_t  book_mtime;    // modification time of the book
+};
+
+struct BookIndexState
+{
+  uint64_t hash;          // compactBoardHash() of key
+  char key[41*4];         // CompactBoard
+  int32_t turn;           // osl::Player
+  uint32_t first_edge;
+  uint32_t edges;
+};
+
+/**
+ * Edges of a state are sorted by WMoveSort and have been checked against
+ * the boards of both ends.
+ */
+struct BookIndexEdge
+{
+  int32_t move;           // osl::Move::intValue()
+  int32_t weight;
+  int32_t next_state;
+};
+
+const uint32_t BOOK_INDEX_VERSION = 1;
+
+/**
+ * Write the index of a book.
+ * @return 0 on success
+ */
+int buildBookIndex(const std::string& book_file, const std::string& index_file);
+
+/**
+ * A book index mapped into memory.  It can be shared among threads.
+ */
+class BookIndex : public BookSource
+{
+public:
+  BookIndex();
+  ~BookIndex();
+
+  /**
+   * Map the index.  If book_file is not empty, the index must have been
+   * built from the current version of the book.
+   * @return 0 on success
+   */
+  int open(const std::string& index_file, const std::string& book_file="");
+
+  int getTotalState() const { return header->total_states; }
+  int getStartState() const { return header->start_state; }
+  osl::Player getTurn(int state_index) {
+    return static_cast<osl::Player>(states[state_index].turn);
+  }
+  const std::string getStateKey(int state_index) {
+    return std::string(states[state_index].key, sizeof(states[state_index].key));
+  }
+  void getMoves(int state_index, edges_t& moves);
+  void checkMove(int, const BookEdge&) {
+    // checked by buildBookIndex()
+  }
+  uint64_t getHash(int state_index) const { return states[state_index].hash; }
+private:
+  void *address;
+  size_t length;
+  const BookIndexHeader *header;
+  const BookIndexState *states;
+  const BookIndexEdge *edges;
+};
+
+#endif /* _GPS_BOOK_INDEX_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -0,0 +1,317 @@
+#include "bookTraversal.h"
+#include "osl/hash/hashKey.h"
+#include "osl/record/compactBoard.h"
+#include "osl/state/simpleState.h"
+#include <glog/logging.h>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <cassert>
+
+typedef std::vector<osl::record::opening::WMove> WMoveContainer;
+
+namespace
+{
+  struct Node
+  {
+    int state_index;
+    int depth;
+    double reach;
+
+    Node(int _state_index, int _depth, double _reach)
+      : state_index(_state_index), depth(_depth), reach(_reach)
+    {}
+  };
+
+  /**
+   * A state reached from a node of the current level.  The states of the
+   * next level are claimed after all the nodes are expanded, in the order
+   * of the nodes and then of their moves, so that the claims do not depend
+   * on the threads.
+   */
+  struct Child
+  {
+    size_t parent_order;  // index of the parent in the level
+    int parent;
+    osl::Move move;
+    Node node;
+
+    Child(size_t _parent_order, int _parent, osl::Move _move, const Node& _node)
+      : parent_order(_parent_order), parent(_parent), move(_move), node(_node)
+    {}
+  };
+
+  bool earlier(const Child& lhs, const Child& rhs)
+  {
+    return lhs.parent_order < rhs.parent_order;
+  }
+
+  /**
+   * Nodes of a level are handed out to threads in chunks of this size.
+   */
+  const size_t CHUNK_SIZE = 64;
+
+  struct Traversal;
+
+  /**
+   * A thread of the traversal.  It owns a book and a sink.
+   */
+  struct Worker
+  {
+    Traversal& traversal;
+    BookSource& book;
+    PositionSink& sink;
+    std::vector<Child> children;
+    moves_t moves_from_root;
+    edges_t moves;
+    size_t appended;
+    std::string error;
+
+    Worker(Traversal& _traversal,
+           BookSource& _book,
+           PositionSink& _sink)
+      : traversal(_traversal), book(_book), sink(_sink), appended(0)
+    {}
+
+    void run();
+    void visit(size_t order, const Node& node);
+  };
+
+  struct Traversal
+  {
+    const TraversalConfig& config;
+    StateBitmap states; // mark states that have been visited.
+    // Both written between levels, and read only in later levels.
+    MovePrefixTree prefixes;
+    std::vector<Worker*> workers;
+    std::vector<Node> level;
+    size_t cursor;
+
+    Traversal(const TraversalConfig& _config, size_t total_states)
+      : config(_config), states(total_states), prefixes(total_states), cursor(0)
+    {}
+  };
+
+  void Worker::run()
+  {
+    try {
+      while (true) {
+        const size_t begin = __sync_fetch_and_add(&traversal.cursor, CHUNK_SIZE);
+        if (begin >= traversal.level.size())
+          break;
+        const size_t end = std::min(begin + CHUNK_SIZE, traversal.level.size());
+        for (size_t i=begin; i<end; ++i)
+          visit(i, traversal.level[i]);
+      }
+    } catch (std::string& e) {
+      error = e;
+    }
+  }
+
+  void Worker::visit(size_t order, const Node& node)
+  {
+    const TraversalConfig& config = traversal.config;
+    DLOG(INFO) << boost::format("Visiting... %d") % node.state_index;
+
+    /* この局面を処理する */
+    const osl::Player turn = book.getTurn(node.state_index);
+    if (turn == osl::alt(config.player)) {
+      // 黒の定跡を評価したい -> 黒の手が指されたあとの局面
+      //                      -> 白手番の局面をサーバに登録する
+      traversal.prefixes.getMoves(node.state_index, moves_from_root);
+      sink.append(book.getStateKey(node.state_index), moves_from_root, node.reach);
+      ++appended;
+    }
+
+    book.getMoves(node.state_index, moves);
+
+    /*
+     * 自分（the_player）の手番では、有望な手(weight>0)のみ抽出する
+     * 相手はどんな手を指すか分からないので、特にfilterせずに、そのまま。
+     */
+    if (!moves.empty() && turn == config.player) {
+      int min = 1;
+      if (config.is_determinate) {
+        min = moves.at(0).weight;
+        if (node.depth <= config.non_determinate_depth) {
+          for (int i=1; i<=std::min(config.is_determinate, (int)moves.size()-1); ++i) {
+            const int weight = moves.at(i).weight;
+            if ((double)weight < (double)moves.at(i-1).weight*config.ratio)
+              break;
+            min = weight;
+          }
+        }
+      }
+      // Do not play 0-weighted moves.
+      if (min == 0) min = 1;
+
+      edges_t::iterator each = moves.begin();
+      for (; each != moves.end(); ++each) {
+        if (each->weight < min)
+          break;
+      }
+      moves.erase(each, moves.end());
+    }
+    DLOG(INFO) << boost::format("  #moves... %d\n") % moves.size();
+
+    /* leaf nodes */
+    if (moves.empty() || node.depth > config.max_depth) {
+      return;
+    }
+
+    // Moves are chosen in proportion to their weights; each weight is
+    // incremented so that 0-weighted moves of the opponent can be reached.
+    double total_weight = 0.0;
+    for (edges_t::const_iterator each = moves.begin();
+         each != moves.end(); ++each) {
+      total_weight += each->weight + 1;
+    }
+
+    // recursively search the tree
+    for (edges_t::const_iterator each = moves.begin();
+         each != moves.end(); ++each) {
+      // consistancy check
+      book.checkMove(node.state_index, *each);
+
+      const int nextIndex = each->next_state;
+      if (!traversal.states.test(nextIndex)) {
+        children.push_back(Child(order, node.state_index, each->move,
+                                 Node(nextIndex, node.depth + 1,
+                                      node.reach * (each->weight + 1) / total_weight)));
+      }
+    } // each wmove
+  }
+} // anonymous namespace
+
+
+WeightedBookSource::WeightedBookSource(const std::string& file_name)
+  : book(file_name.c_str()), board_index(-1)
+{
+}
+
+const osl::SimpleState& WeightedBookSource::getBoard(int state_index)
+{
+  if (state_index != board_index) {
+    board = book.getBoard(state_index);
+    board_index = state_index;
+  }
+  return board;
+}
+
+const std::string WeightedBookSource::getStateKey(int state_index)
+{
+  const osl::record::CompactBoard cb(getBoard(state_index));
+  return compactBoardToString(cb);
+}
+
+void WeightedBookSource::getMoves(int state_index, edges_t& moves)
+{
+  WMoveContainer wmoves = book.getMoves(state_index);
+  std::sort(wmoves.begin(), wmoves.end(), osl::record::opening::WMoveSort());
+  moves.clear();
+  BOOST_FOREACH(const osl::record::opening::WMove& wmove, wmoves) {
+    moves.push_back(BookEdge(wmove.getMove(), wmove.getWeight(), wmove.getStateIndex()));
+  }
+}
+
+void WeightedBookSource::checkMove(int state_index, const BookEdge& move)
+{
+  const osl::hash::HashKey hash(getBoard(state_index));
+  const osl::hash::HashKey next_hash(book.getBoard(move.next_state));
+  const osl::hash::HashKey moved_hash = hash.newMakeMove(move.move);
+  if (moved_hash != next_hash)
+    throw std::string("Illegal move found.");
+}
+
+
+void MovePrefixTree::getMoves(int state_index, moves_t& moves) const
+{
+  moves.clear();
+  for (int i=state_index; entries[i].parent != ROOT; i = entries[i].parent) {
+    moves.push_back(osl::Move::makeDirect(entries[i].move));
+  }
+  std::reverse(moves.begin(), moves.end());
+}
+
+
+size_t traverseBook(BookSource& book,
+                    const TraversalConfig& config,
+                    PositionSink& sink)
+{
+  std::vector<BookSource*> books(1, &book);
+  std::vector<PositionSink*> sinks(1, &sink);
+  return traverseBook(books, config, sinks);
+}
+
+
+size_t traverseBook(const std::vector<BookSource*>& books,
+                    const TraversalConfig& config,
+                    const std::vector<PositionSink*>& sinks)
+{
+  assert(!books.empty());
+  assert(books.size() == sinks.size());
+  const BookSource& book = *books.front();
+
+  Traversal traversal(config, book.getTotalState());
+  for (size_t i=0; i<books.size(); ++i) {
+    traversal.workers.push_back(new Worker(traversal, *books[i], *sinks[i]));
+  }
+
+  LOG(INFO) << boost::format("Start index: %d") % book.getStartState();
+  // depth-1手目からdepth手目のstate。depth手目はまだ指されていない（これか
+  // らdepth手目）
+  traversal.states.set(book.getStartState());
+  traversal.level.push_back(Node(book.getStartState(), 1, 1.0));
+
+  std::string error;
+  while (!traversal.level.empty() && error.empty()) {
+    DLOG(INFO) << boost::format("Depth %d: %d states")
+      % traversal.level.front().depth % traversal.level.size();
+    traversal.cursor = 0;
+    if (traversal.workers.size() == 1) {
+      traversal.workers.front()->run();
+    } else {
+      boost::thread_group threads;
+      BOOST_FOREACH(Worker *worker, traversal.workers) {
+        threads.create_thread(boost::bind(&Worker::run, worker));
+      }
+      threads.join_all();
+    }
+
+    std::vector<Child> children;
+    BOOST_FOREACH(Worker *worker, traversal.workers) {
+      if (error.empty())
+        error = worker->error;
+      children.insert(children.end(),
+                      worker->children.begin(), worker->children.end());
+      worker->children.clear();
+    }
+    // a worker keeps the order of its nodes and moves
+    std::stable_sort(children.begin(), children.end(), earlier);
+
+    traversal.level.clear();
+    BOOST_FOREACH(const Child& child, children) {
+      const int index = child.node.state_index;
+      if (traversal.states.test(index))
+        continue;       // claimed by an earlier node or move
+      traversal.states.set(index);
+      traversal.prefixes.set(index, child.parent, child.move);
+      traversal.level.push_back(child.node);
+    }
+  } // each level
+
+  size_t appended = 0;
+  BOOST_FOREACH(Worker *worker, traversal.workers) {
+    appended += worker->appended;
+    delete worker;
+  }
+  if (!error.empty())
+    throw error;
+  return appended;
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
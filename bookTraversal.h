@@ -0,0 +1,181 @@
+#ifndef _GPS_BOOK_TRAVERSAL_H
+#define _GPS_BOOK_TRAVERSAL_H
+
+#include "searchResult.h"
+#include "osl/record/opening/openingBook.h"
+#include "osl/state/simpleState.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * A set of visited state indices, one bit per state, allocated on the heap.
+ */
+class StateBitmap
+{
+public:
+  explicit StateBitmap(size_t size)
+    : words((size + 63) / 64, 0)
+  {}
+
+  bool test(size_t i) const {
+    return words[i >> 6] & (uint64_t(1) << (i & 63));
+  }
+  void set(size_t i) {
+    words[i >> 6] |= (uint64_t(1) << (i & 63));
+  }
+private:
+  std::vector<uint64_t> words;
+};
+
+/**
+ * Move sequences from the root, shared among states.  Each state holds the
+ * move that reached it and the index of its parent state, so that a state
+ * costs a constant amount of memory regardless of its depth.
+ */
+class MovePrefixTree
+{
+public:
+  static const int ROOT = -1;
+
+  explicit MovePrefixTree(size_t total_states)
+    : entries(total_states, Entry(ROOT, 0))
+  {}
+
+  void set(int state_index, int parent, const osl::Move move) {
+    entries[state_index] = Entry(parent, move.intValue());
+  }
+
+  /**
+   * Rebuild the moves from the root to the state.
+   */
+  void getMoves(int state_index, moves_t& moves) const;
+private:
+  struct Entry {
+    int parent;
+    int move;
+    Entry(int _parent, int _move) : parent(_parent), move(_move) {}
+  };
+  std::vector<Entry> entries;
+};
+
+struct TraversalConfig
+{
+  osl::Player player;
+  int is_determinate;        // test only top n moves.  0 for all
+  int non_determinate_depth;
+  int max_depth;
+  double ratio;              // use moves[n+1] when the weight[n+1] >= ratio*weight[n]
+
+  TraversalConfig()
+    : player(osl::BLACK), is_determinate(0),
+      non_determinate_depth(100), max_depth(100), ratio(0.0)
+  {}
+};
+
+/**
+ * A move in the book.
+ */
+struct BookEdge
+{
+  osl::Move move;
+  int weight;
+  int next_state;
+
+  BookEdge(osl::Move _move, int _weight, int _next_state)
+    : move(_move), weight(_weight), next_state(_next_state)
+  {}
+};
+typedef std::vector<BookEdge> edges_t;
+
+/**
+ * States and moves of a book.  An instance is used by one thread at a time.
+ */
+class BookSource
+{
+public:
+  virtual ~BookSource() {}
+  virtual int getTotalState() const = 0;
+  virtual int getStartState() const = 0;
+  virtual osl::Player getTurn(int state_index) = 0;
+  /**
+   * CompactBoard of the state as a string.
+   */
+  virtual const std::string getStateKey(int state_index) = 0;
+  /**
+   * Moves from the state sorted by WMoveSort.
+   */
+  virtual void getMoves(int state_index, edges_t& moves) = 0;
+  /**
+   * Make sure that the move leads to the board of its next state.
+   * Throws a std::string otherwise.
+   */
+  virtual void checkMove(int state_index, const BookEdge& move) = 0;
+};
+
+/**
+ * Reads a WeightedBook file directly.
+ */
+class WeightedBookSource : public BookSource
+{
+public:
+  explicit WeightedBookSource(const std::string& file_name);
+
+  int getTotalState() const { return book.getTotalState(); }
+  int getStartState() const { return book.getStartState(); }
+  osl::Player getTurn(int state_index) {
+    return getBoard(state_index).turn();
+  }
+  const std::string getStateKey(int state_index);
+  void getMoves(int state_index, edges_t& moves);
+  void checkMove(int state_index, const BookEdge& move);
+private:
+  const osl::SimpleState& getBoard(int state_index);
+
+  osl::record::opening::WeightedBook book;
+  int board_index;  // state of board
+  osl::SimpleState board;
+};
+
+/**
+ * Receives positions to be evaluated.
+ */
+class PositionSink
+{
+public:
+  virtual ~PositionSink() {}
+  /**
+   * @param reach probability of reaching the position following the
+   * weights of the book
+   */
+  virtual void append(const std::string& state_key, const moves_t& moves,
+                      double reach) = 0;
+};
+
+/**
+ * Walk the book from the start state and pass positions where the opponent
+ * of config.player is to move to the sink.
+ * The book is walked level by level and each state is visited once, at
+ * the shallowest depth where it appears, so that the positions appended do
+ * not depend on the visiting order.
+ * @return the number of positions appended
+ */
+size_t traverseBook(BookSource& book,
+                    const TraversalConfig& config,
+                    PositionSink& sink);
+
+/**
+ * Parallel version.  Each thread reads its own book source, which must
+ * hold the same book, and writes to its own sink.  The positions, their
+ * moves and reaches are the same as those of the serial version whatever
+ * the number of threads; only the sinks they go to differ.
+ */
+size_t traverseBook(const std::vector<BookSource*>& books,
+                    const TraversalConfig& config,
+                    const std::vector<PositionSink*>& sinks);
+
+#endif /* _GPS_BOOK_TRAVERSAL_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
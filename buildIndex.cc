@@ -0,0 +1,69 @@
+#include "bookIndex.h"
+#include <glog/logging.h>
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <string>
+
+/**
+ * Global variables
+ */
+
+namespace bp = boost::program_options;
+bp::variables_map vm;
+
+void printUsage(std::ostream& out,
+                char **argv,
+                const boost::program_options::options_description& command_line_options)
+{
+  out <<
+    "Usage: " << argv[0] << " [options] <a_joseki_file.dat>\n"
+      << command_line_options
+      << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  std::string file_name;
+  std::string index_file;
+
+  /* Set up logging */
+  FLAGS_log_dir = ".";
+  google::InitGoogleLogging(argv[0]);
+
+  /* Parse command line options */
+  bp::options_description command_line_options;
+  command_line_options.add_options()
+    ("input-file,f", bp::value<std::string>(&file_name)->default_value("./joseki.dat"),
+     "a joseki file to index.")
+    ("output-file,o", bp::value<std::string>(&index_file)->default_value(""),
+     "an index file to write.  default <a_joseki_file>.idx")
+    ("help,h", "show this help message.");
+  bp::positional_options_description p;
+  p.add("input-file", 1);
+
+  try {
+    bp::store(
+      bp::command_line_parser(
+	argc, argv).options(command_line_options).positional(p).run(), vm);
+    bp::notify(vm);
+    if (vm.count("help")) {
+      printUsage(std::cout, argv, command_line_options);
+      return 0;
+    }
+  } catch (std::exception &e) {
+    std::cerr << "error in parsing options\n"
+	      << e.what() << std::endl;
+    printUsage(std::cerr, argv, command_line_options);
+    return 1;
+  }
+
+  if (index_file.empty())
+    index_file = file_name + ".idx";
+
+  LOG(INFO) << "Indexing " << file_name << " into " << index_file;
+  return buildBookIndex(file_name, index_file);
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
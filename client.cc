@@ -1,23 +1,40 @@
+#include "fakeSearch.h"
+#include "positionKey.h"
 #include "redis.h"
 #include "searchResult.h"
+#include "storage.h"
+#include "workQueue.h"
 #include "osl/eval/ml/openMidEndingEval.h"
 #include "osl/game_playing/alphaBetaPlayer.h"
 #include "osl/game_playing/gameState.h"
+#include "osl/oslConfig.h"
 #include "osl/record/compactBoard.h"
 #include "osl/record/csa.h"
 #include "osl/record/kanjiPrint.h"
 #include "osl/record/ki2.h"
 #include "osl/search/alphaBeta2.h"
-#include <hiredis/hiredis.h>
+#include "osl/search/searchMonitor.h"
+#include "osl/search/simpleHashRecord.h"
 #include <glog/logging.h>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 #include <boost/format.hpp>
+#include <boost/function.hpp>
 #include <boost/program_options.hpp>
-#include <fstream>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <deque>
 #include <iostream>
+#include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 #include <cassert>
+#include <cstdlib>
 
+#include <signal.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -29,23 +46,343 @@
 namespace bp = boost::program_options;
 bp::variables_map vm;
 
-redisContext *c = NULL;
 int depth = 900;
 int max_thingking_seconds = 900;
+bool use_time_manager = false; // stop searches early when they have settled
+int min_seconds = 60;
+int stable_iterations = 3;
+int stable_margin = 64;
 int verbose = 2;
+int threads = 1;        // workers, each searching its own position
+int search_threads = 1; // threads to search a position
+int table_positions = 8; // positions searched with a hash table
+int table_memory = 1024; // megabytes of the hash tables of all the workers
+int lease_seconds = 120; // a position is requeued if not renewed in time
+int prefetch = 1;        // positions popped at a time
+int idle_timeout = 600;  // seconds to wait for new positions, negative for ever
+
+/** finish the current searches, then exit (SIGUSR1) */
+volatile sig_atomic_t stop_requested = 0;
+/** interrupt the current searches and requeue them, then exit (SIGTERM) */
+volatile sig_atomic_t abort_requested = 0;
+
+StorageConfig storage_config;
+/** searches are faked if latency_ms is positive (see fakeSearch()) */
+FakeSearchConfig fake_search;
 
 /**
  * Functions
  */
 
-void search(const osl::NumEffectState& src, SearchResult& sr)
+/**
+ * Renews the leases of the positions held by a worker while a position is
+ * being searched, so that the positions are requeued if this client dies.
+ * The storage is the heartbeat storage of the worker, used only by its
+ * keepers, one at a time.
+ */
+class LeaseKeeper
+{
+public:
+  LeaseKeeper(Storage& storage, const std::vector<position_id_t>& ids)
+    : storage(storage), ids(ids), thread(boost::bind(&LeaseKeeper::run, this)) {}
+  ~LeaseKeeper()
+  {
+    thread.interrupt();
+    thread.join();
+  }
+private:
+  void run();
+  Storage& storage;
+  const std::vector<position_id_t> ids;
+  boost::thread thread;
+};
+
+void LeaseKeeper::run()
+{
+  const int interval = std::max(lease_seconds/3, 1);
+  try {
+    while (true) {
+      boost::this_thread::sleep(boost::posix_time::seconds(interval));
+      storage.renewLeases(leaseDeadline(lease_seconds), ids);
+    }
+  } catch (boost::thread_interrupted&) {
+  }
+}
+
+
+/**
+ * Depths of search monitors are in plies, while depth limits, including
+ * the depth option, are in 1/200 plies.
+ */
+const int PLY_DEPTH = 200;
+
+/**
+ * Writes the principal variation of each completed iteration of iterative
+ * deepening to the hash of the position, so that the work survives the
+ * client.  Called on the searching thread, which owns the connection.
+ */
+class Checkpointer : public osl::search::SearchMonitor
+{
+public:
+  explicit Checkpointer(Storage& storage)
+    : storage(storage), id(0), pv_depth(0), written_depth(0), completed_depth(0),
+      score(0) {}
+
+  /**
+   * @param checkpoint_depth depth of the existing checkpoint, which is
+   * replaced only by deeper ones
+   */
+  void start(position_id_t id, int checkpoint_depth);
+  /**
+   * Depth of the last iteration known to have been completed.
+   */
+  int getCompletedDepth() const { return completed_depth; }
+  /**
+   * Depth of the last principal variation, that of the last iteration
+   * if the search has not been cut short.
+   */
+  int getLastDepth() const { return pv_depth; }
+  void newDepth(int depth);
+  void showPV(int depth, size_t node_count, double elapsed, int value,
+              osl::Move cur, const osl::Move *first, const osl::Move *last,
+              const bool *threatmate_first, const bool *threatmate_last);
+private:
+  Storage& storage;
+  position_id_t id;
+  int pv_depth, written_depth, completed_depth;
+  int score;
+  std::string pv;
+};
+
+void Checkpointer::start(position_id_t new_id, int checkpoint_depth)
+{
+  id = new_id;
+  pv_depth = completed_depth = 0;
+  written_depth = checkpoint_depth;
+  score = 0;
+  pv.clear();
+}
+
+void Checkpointer::showPV(int depth, size_t /*node_count*/, double /*elapsed*/, int value,
+                          osl::Move cur, const osl::Move *first, const osl::Move *last,
+                          const bool * /*threatmate_first*/, const bool * /*threatmate_last*/)
+{
+  pv_depth = depth * PLY_DEPTH;
+  score = value;
+  moves_t moves;
+  if (first == last || *first != cur)
+    moves.push_back(cur);
+  moves.insert(moves.end(), first, last);
+  pv = movesToCsaString(moves);
+}
+
+void Checkpointer::newDepth(int depth)
+{
+  /* the iteration of pv_depth has been completed */
+  if (depth * PLY_DEPTH <= pv_depth)
+    return;
+  completed_depth = std::max(completed_depth, pv_depth);
+  if (pv_depth <= written_depth)
+    return;
+
+  storage.setCheckpoint(id, pv_depth, score, pv);
+  written_depth = pv_depth;
+  DLOG(INFO) << "Checkpoint " << id << " at depth " << pv_depth;
+}
+
+
+/**
+ * Stops a search early when its best move and score have been stable for
+ * stable_iterations iterations, after min_seconds.  The soft budget starts
+ * at the middle of min_seconds and max_thingking_seconds, and is extended
+ * when the score swings.  Settled searches also stop at the soft budget,
+ * while others run up to max_thingking_seconds, the hard limit given to
+ * the player.
+ */
+class TimeManager : public osl::search::SearchMonitor
+{
+public:
+  explicit TimeManager(const boost::function<void()>& stop)
+    : stop(stop)
+  {
+    start();
+  }
+
+  void start();
+  void newDepth(int depth);
+  void showPV(int depth, size_t node_count, double elapsed, int value,
+              osl::Move cur, const osl::Move *first, const osl::Move *last,
+              const bool *threatmate_first, const bool *threatmate_last);
+private:
+  boost::function<void()> stop;
+  bool has_pv, has_last;
+  osl::Move best_move, last_move;
+  int score, last_score;
+  int stable;     // iterations with the same best move and score
+  double elapsed; // seconds
+  double budget;  // seconds
+};
+
+void TimeManager::start()
 {
-  osl::game_playing::AlphaBeta2OpenMidEndingEvalPlayer player;
-  player.setNextIterationCoefficient(3.0);
-  player.setVerbose(verbose);
-  player.setTableLimit(std::numeric_limits<size_t>::max(), 200);
-  player.setNodeLimit(std::numeric_limits<size_t>::max());
-  player.setDepthLimit(depth, 400, 200);
+  has_pv = has_last = false;
+  best_move = last_move = osl::Move();
+  score = last_score = 0;
+  stable = 0;
+  elapsed = 0.0;
+  budget = (min_seconds + max_thingking_seconds) / 2.0;
+}
+
+void TimeManager::showPV(int /*depth*/, size_t /*node_count*/, double elapsed_seconds, int value,
+                         osl::Move cur, const osl::Move * /*first*/, const osl::Move * /*last*/,
+                         const bool * /*threatmate_first*/, const bool * /*threatmate_last*/)
+{
+  has_pv = true;
+  best_move = cur;
+  score = value;
+  elapsed = elapsed_seconds;
+}
+
+void TimeManager::newDepth(int /*depth*/)
+{
+  if (!has_pv)
+    return;
+
+  /* an iteration has been completed */
+  if (has_last) {
+    const int swing = std::abs(score - last_score);
+    if (best_move == last_move && swing <= stable_margin) {
+      ++stable;
+    } else {
+      stable = 0;
+      if (swing > stable_margin)
+        budget = std::min(budget * 1.5, (double)max_thingking_seconds);
+    }
+  }
+  has_last = true;
+  last_move = best_move;
+  last_score = score;
+
+  if (elapsed < min_seconds)
+    return;
+  if (stable >= stable_iterations || (stable > 0 && elapsed >= budget)) {
+    LOG(INFO) << "Stop the settled search after " << elapsed << " seconds";
+    stop();
+  }
+}
+
+
+/**
+ * A search player kept across positions.  Consecutive positions often
+ * share subtrees, so the hash table of the player is reused until
+ * table_positions positions have been searched, then the player is
+ * renewed to drop old entries.  The table of each worker is capped at its
+ * share of table_memory.
+ */
+class Searcher
+{
+public:
+  explicit Searcher(Storage& storage);
+  ~Searcher();
+
+  /**
+   * Iterative deepening resumes from the checkpoint of sr, if any, instead
+   * of repeating the iterations below it.  sr.depth is lowered from the
+   * target to the depth of the last iteration completed, or taken from the
+   * checkpoint of sr if that is deeper.  sr.settled is set if the time
+   * manager has stopped the search.
+   * @param pv the best move followed by the principal variation
+   */
+  void search(const osl::NumEffectState& src, SearchResult& sr, moves_t& pv);
+  /**
+   * Interrupt the current search.  Called from another thread.
+   */
+  void stop();
+  /**
+   * Stop the current search as its result has settled.  Called by the time
+   * manager on the searching thread.
+   */
+  void settle();
+private:
+  typedef osl::game_playing::AlphaBeta2OpenMidEndingEvalPlayer player_t;
+  boost::scoped_ptr<player_t> player;
+  boost::mutex mutex; // guards player against stop()
+  boost::shared_ptr<Checkpointer> checkpointer;
+  boost::shared_ptr<TimeManager> time_manager;
+  int searched;
+  volatile bool stopped; // by stop() during the current search
+  bool settled;          // by settle() during the current search
+  unsigned int seed;     // of fake searches
+};
+
+/**
+ * Searchers to be stopped by signals
+ */
+boost::mutex searchers_mutex;
+std::set<Searcher*> searchers;
+
+Searcher::Searcher(Storage& storage)
+  : checkpointer(new Checkpointer(storage)),
+    time_manager(new TimeManager(boost::bind(&Searcher::settle, this))),
+    searched(0), stopped(false), settled(false), seed(getpid() ^ (unsigned int)(size_t)this)
+{
+  boost::mutex::scoped_lock lock(searchers_mutex);
+  searchers.insert(this);
+}
+
+Searcher::~Searcher()
+{
+  boost::mutex::scoped_lock lock(searchers_mutex);
+  searchers.erase(this);
+}
+
+void Searcher::stop()
+{
+  boost::mutex::scoped_lock lock(mutex);
+  stopped = true;
+  if (player)
+    player->stopSearchNow();
+}
+
+void Searcher::settle()
+{
+  settled = true;
+  stop();
+}
+
+void Searcher::search(const osl::NumEffectState& src, SearchResult& sr, moves_t& pv)
+{
+  if (fake_search.latency_ms > 0) {
+    fakeSearch(fake_search, src, sr, pv, seed, abort_requested);
+    return;
+  }
+
+  if (!player || (table_positions > 0 && searched >= table_positions)) {
+    boost::mutex::scoped_lock lock(mutex);
+    player.reset(new player_t);
+    player->setNextIterationCoefficient(3.0);
+    player->setVerbose(verbose);
+    /* the table grows over table_positions searches; bound it */
+    const size_t table_bytes = (size_t)std::max(table_memory, 1) * 1024 * 1024
+      / std::max(threads, 1);
+    player->setTableLimit(table_bytes / sizeof(osl::search::SimpleHashRecord), 200);
+    player->setNodeLimit(std::numeric_limits<size_t>::max());
+    player->addMonitor(checkpointer);
+    if (use_time_manager)
+      player->addMonitor(time_manager);
+    searched = 0;
+  }
+  ++searched;
+  const int initial_depth = std::max(400, std::min(sr.partial_depth, depth));
+  if (initial_depth > 400)
+    LOG(INFO) << "Resume from depth " << initial_depth;
+  player->setDepthLimit(depth, initial_depth, 200);
+  checkpointer->start(sr.id, sr.partial_depth);
+  time_manager->start();
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    stopped = settled = false;
+  }
 
   osl::game_playing::GameState state(src);
   const int sec = max_thingking_seconds;
@@ -53,89 +390,228 @@ void search(const osl::NumEffectState& src, SearchResult& sr)
 
   const osl::MilliSeconds start_time = osl::MilliSeconds::now();
   osl::search::AlphaBeta2SharedRoot root_info;
-  osl::MoveWithComment move = player.analyzeWithSeconds(state, time, root_info);
+  osl::MoveWithComment move = player->analyzeWithSeconds(state, time, root_info);
   const osl::MilliSeconds finish_time = osl::MilliSeconds::now();
   const double consumed = (finish_time - start_time).toSeconds();
   sr.consumed_seconds = (int)consumed;
   sr.score = move.value;
+  /*
+   * A search cut short has reached only the iterations it completed, and
+   * one that OSL ends before the limit has reached its last iteration.  A
+   * search without iterations, e.g. of a mated position, keeps the target.
+   */
+  if (stopped || consumed >= max_thingking_seconds)
+    sr.depth = std::min(sr.depth, checkpointer->getCompletedDepth());
+  else if (checkpointer->getLastDepth() > 0)
+    sr.depth = std::min(sr.depth, checkpointer->getLastDepth());
+  sr.settled = settled && !abort_requested;
+  if (sr.partial_depth > sr.depth) {
+    LOG(INFO) << "Use the deeper checkpoint: " << sr.id;
+    sr.depth = sr.partial_depth;
+    sr.score = sr.partial_score;
+    sr.pv = sr.partial_pv;
+    sr.pv_moves.clear();
+    pv.clear();
+    return;
+  }
 
-  std::ostringstream out;
+  pv.clear();
   if (move.move.isNormal()) {
-    out << osl::record::csa::show(move.move);
-    out << movesToCsaString(move.moves);
+    pv.push_back(move.move);
+    pv.insert(pv.end(), move.moves.begin(), move.moves.end());
   }
-  sr.pv = out.str();
+  sr.pv_moves = pv;
+  sr.pv.clear();
 }
 
 
-int getQueueLength()
+/**
+ * The position two plies ahead along the principal variation, which is
+ * the next position of the same player in the book if the book follows
+ * the principal variation.
+ * @param canonical whether master keys positions by the canonical boards
+ * @return false if the principal variation is too short
+ */
+bool nextPosition(const osl::SimpleState& src, const moves_t& pv, bool canonical,
+                  position_id_t& id)
 {
-  redisReplyPtr reply((redisReply*)redisCommand(c, "SCARD %s", "tag:new-queue"),
-                      freeRedisReply);
-  if (checkRedisReply(reply))
-    exit(1);
+  if (pv.size() < 2)
+    return false;
+  osl::NumEffectState state(src);
+  for (size_t i=0; i<2; ++i) {
+    if (!pv[i].isNormal() || !state.isValidMove(pv[i], false))
+      return false;
+    state.makeMove(pv[i]);
+  }
+  if (canonical) {
+    bool mirrored;
+    id = compactBoardHash(canonicalBoardString(state, mirrored));
+  } else {
+    id = compactBoardHash(compactBoardToString(osl::record::CompactBoard(state)));
+  }
+  return true;
+}
 
-  assert(reply->type == REDIS_REPLY_INTEGER);
-  return reply->integer;
+
+/**
+ * A worker has its own storage and searcher.  Positions are popped
+ * prefetch at a time, and those already searched deep enough are
+ * discarded at once.  Results are kept until the next batch is popped,
+ * then written together.  The leases of all the positions held
+ * are renewed while searching, through a second storage kept for the
+ * lifetime of the worker.
+ */
+class Worker
+{
+public:
+  Worker();
+  ~Worker();
+
+  /**
+   * @return 0 on success, 1 if no position is available
+   */
+  int doPosition();
+  int getQueueLength() { return storage->getQueueLength(); }
+  /**
+   * Wait until master queues new positions, a stop is requested or the
+   * seconds pass.
+   */
+  void waitForWork(int seconds);
+private:
+  int fetch();
+  void flush();
+  const std::vector<position_id_t> heldPositions(position_id_t current) const;
+
+  boost::shared_ptr<Storage> storage;
+  boost::shared_ptr<Storage> heartbeat; // for LeaseKeeper
+  Searcher searcher;
+  std::deque<SearchResult> batch;     // positions to be searched
+  std::vector<SearchResult> results;  // results to be written
+  std::vector<position_id_t> skipped; // leases to be released
+  bool canonical;
+  /** the next position along the principal variation */
+  bool has_next;
+  position_id_t next;
+};
+
+Worker::Worker()
+  : storage(openStorage(storage_config)), heartbeat(openStorage(storage_config)),
+    searcher(*storage),
+    canonical(storage->isCanonicalMode()), has_next(false), next(0)
+{
+  storage->subscribeNewWork();
+}
+
+Worker::~Worker()
+{
+  flush();
+  std::vector<position_id_t> unsearched;
+  BOOST_FOREACH(const SearchResult& sr, batch) {
+    unsearched.push_back(sr.id);
+  }
+  storage->requeueLeases(unsearched);
 }
 
+void Worker::waitForWork(int seconds)
+{
+  /* wake up every second to see stop requests */
+  for (int i=0; i<seconds && !stop_requested; ++i) {
+    if (!storage->waitForNewWork(1000))
+      return;
+  }
+}
 
-int popPosition(osl::record::CompactBoard& cb)
+int Worker::fetch()
 {
-  redisReplyPtr reply((redisReply*)redisCommand(c, "SPOP %s", "tag:new-queue"),
-                      freeRedisReply);
-  if (checkRedisReply(reply))
-    exit(1);
+  flush();
 
-  if (reply->type == REDIS_REPLY_NIL)
+  const long long deadline = leaseDeadline(lease_seconds);
+  std::vector<position_id_t> ids;
+  if (has_next && !storage->claimPosition(deadline, next)) {
+    DLOG(INFO) << "Follow the principal variation: " << next;
+    ids.push_back(next);
+  }
+  has_next = false;
+  std::vector<position_id_t> popped;
+  if (ids.size() < (size_t)prefetch
+      && !storage->popPositions(deadline, prefetch - ids.size(), popped)) {
+    ids.insert(ids.end(), popped.begin(), popped.end());
+  }
+  if (ids.empty())
     return 1;
 
-  if (reply->type == REDIS_REPLY_STRING) {
-    const std::string str(reply->str, reply->len);
-    std::istringstream in(str);
-    in >> cb;
+  /* Read the boards and the current (i.e. previous) results */
+  std::vector<SearchResult> fetched;
+  BOOST_FOREACH(const position_id_t id, ids) {
+    fetched.push_back(SearchResult(id));
+  }
+  std::vector<int> found;
+  storage->querySearchResults(fetched, &found);
+  for (size_t i=0; i<fetched.size(); ++i) {
+    if (!found[i]) {
+      LOG(WARNING) << "Position not found: " << fetched[i].id;
+      skipped.push_back(fetched[i].id);
+    } else if (isSearchedEnough(fetched[i].depth, fetched[i].settled, depth)) {
+      DLOG(INFO) << "Do not update the current search result: " << fetched[i].id;
+      skipped.push_back(fetched[i].id);
+    } else if (fetched[i].partial_depth >= depth) {
+      /* an interrupted search reached the depth */
+      SearchResult& sr = fetched[i];
+      LOG(INFO) << "Use the checkpoint: " << sr.id;
+      sr.depth = sr.partial_depth;
+      sr.score = sr.partial_score;
+      sr.pv = sr.partial_pv;
+      sr.pv_moves.clear();
+      sr.timestamp = time(NULL);
+      results.push_back(sr);
+    } else {
+      batch.push_back(fetched[i]);
+    }
   }
+  LOG(INFO) << ">>> Popped " << ids.size() << " positions, "
+            << batch.size() << " to search";
   return 0;
 }
 
-
-int setResult(const SearchResult& sr)
+void Worker::flush()
 {
-  const std::string key = compactBoardToString(sr.board);
-  redisReplyPtr reply((redisReply*)redisCommand(c, "HMSET %b depth %d score %d consumed %d pv %b timestamp %d",
-                                                key.c_str(), key.size(),
-                                                sr.depth,
-                                                sr.score,
-                                                sr.consumed_seconds,
-                                                sr.pv.c_str(), sr.pv.size(),
-                                                sr.timestamp),
-                      freeRedisReply);
-  LOG(INFO) << sr.toString();
-  if (checkRedisReply(reply))
-    exit(1);
-
-  return 0;
+  storage->setResults(results);
+  BOOST_FOREACH(const SearchResult& sr, results) {
+    LOG(INFO) << sr.toString();
+    skipped.push_back(sr.id);
+  }
+  results.clear();
+  storage->releaseLeases(skipped);
+  skipped.clear();
 }
 
+const std::vector<position_id_t> Worker::heldPositions(position_id_t current) const
+{
+  std::vector<position_id_t> ids(1, current);
+  BOOST_FOREACH(const SearchResult& sr, batch) {
+    ids.push_back(sr.id);
+  }
+  BOOST_FOREACH(const SearchResult& sr, results) {
+    ids.push_back(sr.id);
+  }
+  ids.insert(ids.end(), skipped.begin(), skipped.end());
+  return ids;
+}
 
-int doPosition()
+int Worker::doPosition()
 {
-  osl::record::CompactBoard cb;
-  if (popPosition(cb)) {
+  if (stop_requested)
     return 1;
-  }
+  if (batch.empty() && fetch())
+    return 1;
+  if (batch.empty())
+    return 0; // all of the batch have been searched deep enough
 
-  SearchResult sr(cb);
-  /* Check the current (i.e. previous) result */
-  if (!querySearchResult(c, sr)) {
-    if (sr.depth >= depth) {
-      DLOG(INFO) << "Do not update the current search result.";
-      return 0;
-    }
-    DLOG(INFO) << "Will update the current search result.";
-  }
-  
-  const osl::SimpleState state = cb.getState();
+  SearchResult sr = batch.front();
+  batch.pop_front();
+  DLOG(INFO) << "Will update the current search result.";
+
+  const osl::SimpleState state = sr.board.getState();
   
   {
     std::ostringstream oss;
@@ -145,36 +621,78 @@ int doPosition()
   }
 
   sr.depth = depth;
-  search(osl::NumEffectState(state), sr);
-  setResult(sr);
+  moves_t pv;
+  {
+    LeaseKeeper keeper(*heartbeat, heldPositions(sr.id));
+    searcher.search(osl::NumEffectState(state), sr, pv);
+  }
+  if (abort_requested) {
+    LOG(WARNING) << "Search interrupted: " << sr.id;
+    batch.push_front(sr); // to be requeued
+    return 0;
+  }
+  results.push_back(sr);
+  has_next = nextPosition(state, pv, canonical, next);
   return 0;
 }
 
-bool isStopFileExist()
+/**
+ * The evaluation tables are shared among workers.
+ */
+void doMain()
 {
-  bool ret = false;
-  std::ifstream fin;
-  fin.open("stop");
-  ret = fin.is_open();
-  fin.close();
-  
-  if (ret) {
-    LOG(INFO) << "Found the stop file";
+  Worker worker;
+  time_t idle_since = 0;
+
+  while (!stop_requested) {
+    if (!worker.doPosition()) {
+      idle_since = 0;
+      continue;
+    }
+    if (stop_requested)
+      break;
+
+    const time_t now = time(NULL);
+    if (idle_since == 0)
+      idle_since = now;
+    const int idle = now - idle_since;
+    if (idle_timeout >= 0 && idle >= idle_timeout) {
+      const int queue_length = worker.getQueueLength();
+      LOG(INFO) << ">>> Queue length: " << queue_length;
+      if (queue_length == 0) {
+        break;
+      }
+    }
+
+    /* positions leased by other clients may come back when leases expire */
+    int seconds = lease_seconds;
+    if (idle_timeout >= 0 && idle < idle_timeout)
+      seconds = std::min(seconds, idle_timeout - idle);
+    worker.waitForWork(std::max(seconds, 1));
   }
-  return ret;
 }
 
-void doMain()
+/**
+ * Handle signals on a dedicated thread, as the other threads block them.
+ */
+void watchSignals(sigset_t signals)
 {
-  while (!isStopFileExist()) {
-    const int queue_length = getQueueLength();
-    LOG(INFO) << ">>> Queue length: " << queue_length;
-    if (queue_length == 0) {
-      break;
+  while (true) {
+    int signal;
+    if (sigwait(&signals, &signal))
+      continue;
+
+    stop_requested = 1;
+    if (signal == SIGUSR1) {
+      LOG(WARNING) << "Stop after the current searches";
+      continue;
+    }
+    LOG(WARNING) << "Interrupt the current searches";
+    abort_requested = 1;
+    boost::mutex::scoped_lock lock(searchers_mutex);
+    BOOST_FOREACH(Searcher *searcher, searchers) {
+      searcher->stop();
     }
-
-    if (doPosition())
-      sleep(10);
   }
 }
 
@@ -191,10 +709,6 @@ void printUsage(std::ostream& out,
 
 int main(int argc, char **argv)
 {
-  std::string redis_server_host = "127.0.0.1";
-  int redis_server_port = 6379;
-  std::string redis_password;
-
   /* Set up logging */
   FLAGS_log_dir = ".";
   google::InitGoogleLogging(argv[0]);
@@ -204,12 +718,45 @@ int main(int argc, char **argv)
   command_line_options.add_options()
     ("depth", bp::value<int>(&depth)->default_value(depth),
      "depth to search")
-    ("redis-host", bp::value<std::string>(&redis_server_host)->default_value(redis_server_host),
+    ("max-seconds", bp::value<int>(&max_thingking_seconds)->default_value(max_thingking_seconds),
+     "seconds to search a position at most")
+    ("time-manager", bp::bool_switch(&use_time_manager),
+     "stop searches early when their best moves and scores are stable")
+    ("min-seconds", bp::value<int>(&min_seconds)->default_value(min_seconds),
+     "seconds to search a position at least with --time-manager")
+    ("stable-iterations", bp::value<int>(&stable_iterations)->default_value(stable_iterations),
+     "iterations with the same best move to stop a search with --time-manager")
+    ("stable-margin", bp::value<int>(&stable_margin)->default_value(stable_margin),
+     "score difference regarded as stable with --time-manager")
+    ("local-storage", bp::value<std::string>(&storage_config.local_dir),
+     "directory of the local storage to use instead of the redis server")
+    ("redis-host", bp::value<std::string>(&storage_config.redis.host)->default_value(storage_config.redis.host),
      "IP of the redis server")
-    ("redis-password", bp::value<std::string>(&redis_password)->default_value(redis_password),
+    ("redis-password", bp::value<std::string>(&storage_config.redis.password)->default_value(storage_config.redis.password),
      "password to connect to the redis server")
-    ("redis-port", bp::value<int>(&redis_server_port)->default_value(redis_server_port),
+    ("redis-port", bp::value<int>(&storage_config.redis.port)->default_value(storage_config.redis.port),
      "port number of the redis server")
+    ("redis-retry-seconds", bp::value<int>(&storage_config.redis.retry_seconds)->default_value(storage_config.redis.retry_seconds),
+     "seconds to keep trying to connect again when the connection is lost")
+    ("threads", bp::value<int>(&threads)->default_value(threads),
+     "number of positions searched at the same time")
+    ("search-threads", bp::value<int>(&search_threads)->default_value(search_threads),
+     "number of threads to search a position (requires OSL built with OSL_SMP)")
+    ("table-positions", bp::value<int>(&table_positions)->default_value(table_positions),
+     "number of positions searched before renewing the hash table.  0 for never")
+    ("table-memory", bp::value<int>(&table_memory)->default_value(table_memory),
+     "megabytes of the hash tables, divided among --threads")
+    ("prefetch", bp::value<int>(&prefetch)->default_value(prefetch),
+     "number of positions popped at a time")
+    ("idle-timeout", bp::value<int>(&idle_timeout)->default_value(idle_timeout),
+     "seconds to wait for new positions when the queue is empty.  negative for ever")
+    ("lease-seconds", bp::value<int>(&lease_seconds)->default_value(lease_seconds),
+     "seconds before a position of a dead client is requeued")
+    ("simulate-ms", bp::value<int>(&fake_search.latency_ms)->default_value(fake_search.latency_ms),
+     "fake each search by sleeping for this mean number of milliseconds, "
+     "to measure the queue and the storage.  0 for real searches")
+    ("simulate-spread", bp::value<double>(&fake_search.spread)->default_value(fake_search.spread),
+     "fake searches take --simulate-ms times 1 +/- this fraction")
     ("verbose,v",  bp::value<int>(&verbose)->default_value(verbose),
      "output verbose messages.")
     ("help,h", "show this help message.");
@@ -232,28 +779,37 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  /* Connect to the Redis server */
-  connectRedisServer(&c, redis_server_host, redis_server_port);
-  if (!c) {
-    LOG(FATAL) << "Failed to connect to the Redis server";
-    exit(1);
-  }
-  if (!redis_password.empty()) {
-    if (!authenticate(c, redis_password)) {
-      LOG(FATAL) << "Failed to authenticate to the Redis server";
-      exit(1);
-    }
-  }
+  prefetch = std::max(prefetch, 1);
 
   /* Set up OSL */
-  osl::eval::ml::OpenMidEndingEval::setUp();
-  osl::progress::ml::NewProgress::setUp();
+  osl::OslConfig::setNumCPUs(std::max(search_threads, 1));
+  if (fake_search.latency_ms <= 0) {
+    osl::eval::ml::OpenMidEndingEval::setUp();
+    osl::progress::ml::NewProgress::setUp();
+  }
+
+  /* Signals are handled only by the watcher */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  boost::thread watcher(boost::bind(&watchSignals, signals));
+  watcher.detach();
 
   /* MAIN */
-  doMain();
+  if (threads <= 1) {
+    doMain();
+  } else {
+    boost::thread_group workers;
+    for (int i=0; i<threads; ++i) {
+      workers.create_thread(&doMain);
+    }
+    workers.join_all();
+  }
+  logStorageStats(storage_config);
 
-  /* Clean up things */
-  redisFree(c);
   return 0;
 }
 // ;;; Local Variables:
@@ -3,10 +3,10 @@
 unset GLOG_logtostderr
 
 nclients=${1:-1}
+nthreads=${2:-1}   # positions searched by a client at the same time
 
-if [ -e stop ] ; then
-  rm stop
-fi
+# To stop the clients after the current searches:  pkill -USR1 client
+# To stop them at once, requeueing the current positions:  pkill client
 
 for i in {1..${nclients}}
 do
@@ -14,5 +14,6 @@ do
                 --redis-port ${GPS_REDIS_PORT:?GPS_REDIS_PORT not found} \
                 --redis-password ${GPS_REDIS_PASSWORD:?GPS_REDIS_PASSWORD not found} \
                 -v 0 \
+                --threads ${nthreads} \
                 --depth 1400 &
 done
@@ -0,0 +1,46 @@
+#include "fakeSearch.h"
+#include "osl/move_generator/legalMoves.h"
+#include "osl/record/compactBoard.h"
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <cstdlib>
+
+int fakeSearch(const FakeSearchConfig& config, const osl::NumEffectState& src,
+               SearchResult& sr, moves_t& pv, unsigned int& seed,
+               const volatile sig_atomic_t& stop)
+{
+  const double spread = std::max(0.0, std::min(config.spread, 1.0));
+  const double ratio = 1.0 - spread + 2.0 * spread * rand_r(&seed) / RAND_MAX;
+  const int latency_ms = (int)(config.latency_ms * ratio + 0.5);
+
+  /* wake up every 100 milliseconds to see stop */
+  int slept = 0;
+  while (slept < latency_ms && !stop) {
+    const int ms = std::min(latency_ms - slept, 100);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(ms));
+    slept += ms;
+  }
+
+  const uint64_t hash = compactBoardHash(compactBoardToString(osl::record::CompactBoard(src)));
+  sr.score = (int)(hash % 2001) - 1000;
+  sr.consumed_seconds = slept / 1000;
+
+  pv.clear();
+  osl::NumEffectState state(src);
+  for (int i=0; i<2; ++i) {
+    osl::MoveVector moves;
+    osl::LegalMoves::generate(state, moves);
+    if (moves.empty())
+      break;
+    const osl::Move move = moves[rand_r(&seed) % moves.size()];
+    state.makeMove(move);
+    pv.push_back(move);
+  }
+  sr.pv_moves = pv;
+  sr.pv.clear();
+  return slept;
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
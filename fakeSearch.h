@@ -0,0 +1,33 @@
+#ifndef _GPS_FAKE_SEARCH_H
+#define _GPS_FAKE_SEARCH_H
+
+#include "searchResult.h"
+#include "osl/state/numEffectState.h"
+#include <signal.h>
+
+struct FakeSearchConfig
+{
+  int latency_ms;  // mean milliseconds of a search.  0 for real searches
+  double spread;   // latencies are uniform in latency_ms * [1-spread, 1+spread]
+
+  FakeSearchConfig() : latency_ms(0), spread(0.5) {}
+};
+
+/**
+ * Stands in for a search to measure master, clients and the storage
+ * without spending CPU on searches.  Sleeps for a random latency, then
+ * scores the state by the hash of its board and makes a principal
+ * variation of two random legal moves.
+ * @param stop the sleep ends early when it becomes nonzero
+ * @param seed of rand_r()
+ * @return milliseconds slept
+ */
+int fakeSearch(const FakeSearchConfig& config, const osl::NumEffectState& state,
+               SearchResult& sr, moves_t& pv, unsigned int& seed,
+               const volatile sig_atomic_t& stop);
+
+#endif /* _GPS_FAKE_SEARCH_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -1,21 +1,28 @@
+#include "positionKey.h"
 #include "redis.h"
+#include "scoreStatistics.h"
 #include "searchResult.h"
+#include "storage.h"
 #include "osl/record/compactBoard.h"
 #include "osl/record/csa.h"
 #include "osl/record/kanjiPrint.h"
 #include "osl/record/ki2.h"
 #include "osl/state/simpleState.h"
-#include <hiredis/hiredis.h>
 #include <glog/logging.h>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/program_options.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <cassert>
+#include <cstdlib>
 
 /**
  * Global variables
@@ -27,63 +34,133 @@ osl::Player the_player = osl::BLACK;
 std::string the_player_str = "black";
 int depth = 900;
 
-redisContext *c = NULL;
+StorageConfig storage_config;
+boost::shared_ptr<Storage> storage;
 
-void getAllBoards(std::vector<osl::record::CompactBoard>& boards)
+size_t batch_size = 1000;
+int threads = 1; // threads to render positions
+int bin_width = 50;
+
+/** score and id of a result searched deep enough */
+typedef std::pair<int, position_id_t> scored_id_t;
+
+/**
+ * Keep the score of a result searched enough (see isSearchedEnough()), or
+ * count the position missed.  The statistics are computed as the scores
+ * stream in.  SSCAN may visit a position more than once; only the first
+ * visit counts.
+ */
+void collectScore(std::vector<scored_id_t> *scores, std::set<position_id_t> *visited,
+                  size_t *missed, ScoreStatistics *statistics,
+                  position_id_t id, int result_depth, int score, bool settled)
 {
-  const std::string key = "tag:" + the_player_str + "-positions";
-  redisReplyPtr reply((redisReply*)redisCommand(c, "SMEMBERS %s", key.c_str(),
-                                                freeRedisReply));
-  if (checkRedisReply(reply))
-    exit(1);
-  assert(reply->type == REDIS_REPLY_ARRAY);
-
-  if (reply->elements == 0) {
-    LOG(WARNING) << "No board found";
+  if (!visited->insert(id).second)
+    return;
+  if (!isSearchedEnough(result_depth, settled, depth)) {
+    *missed += 1;
     return;
   }
+  scores->push_back(scored_id_t(score, id));
+  /* from the view of the player */
+  statistics->add(the_player == osl::WHITE ? -score : score);
+}
 
-  DLOG(INFO) << "size: " << reply->elements;
-  boards.reserve(reply->elements);
-  for(size_t i=0; i<reply->elements; ++i) {
-    const redisReply *r = reply->element[i];
-    assert(r->type == REDIS_REPLY_STRING);
-    assert(r->len == 41*4);
-    const std::string key(r->str, r->len);
-    std::stringstream ss;
-    ss << key;
-    osl::record::CompactBoard cb;
-    ss >> cb;
-    boards.push_back(cb);
-  }
+/**
+ * Scan the scores of the positions of the player.  Only the scores and
+ * ids of results searched enough are kept, sorted in the order of the
+ * report.
+ */
+void scanScores(std::vector<scored_id_t>& scores, size_t& missed,
+                ScoreStatistics& statistics)
+{
+  std::set<position_id_t> visited;
+  missed = 0;
+  storage->scanPositions(the_player,
+                         boost::bind(&collectScore, &scores, &visited, &missed, &statistics,
+                                     _1, _2, _3, _4));
+
+  std::sort(scores.begin(), scores.end());
+  if (the_player == osl::WHITE)
+    std::reverse(scores.begin(), scores.end());
+}
+
+void dump_summary(const ScoreStatistics& statistics)
+{
+  const std::string file_name = "summary_" + the_player_str + ".txt";
+  std::ofstream out(file_name.c_str(), std::ios_base::trunc);
+
+  LOG(INFO) << "Writing to " << file_name << "...";
+  out << "player:  " << the_player_str;
+  if (the_player == osl::WHITE)
+    out << " with eval reversed";
+  out << "\n";
+  statistics.write(out);
 }
 
-void dump_score(const std::vector<SearchResult>& results, osl::Player player)
+void dump_score(const std::vector<scored_id_t>& scores, size_t missed)
 {
   const std::string file_name = "score_" + the_player_str + ".csv";
   std::ofstream out(file_name.c_str(), std::ios_base::trunc);
 
   LOG(INFO) << "Writing to " << file_name << "...";
-  size_t missed = 0;
 
   /* Header */
   out << "EVAL" << std::endl;
 
   /* Rows */
-  BOOST_FOREACH(const SearchResult& sr, results) {
-    const osl::SimpleState state = sr.board.getState();
-    /* Filter results */
-    if (sr.depth >= depth) {
-      out << sr.score << std::endl;
-    } else {
-      missed += 1;
-    }
+  BOOST_FOREACH(const scored_id_t& score, scores) {
+    out << score.first << std::endl;
   }  
 
   LOG(INFO) << "  misses: " << missed;
 }
 
-void dump_position(const std::vector<SearchResult>& results, osl::Player player)
+void printPosition(std::ostream& out, const SearchResult& sr)
+{
+  const osl::SimpleState state = sr.board.getState();
+
+  osl::Move last_move;
+  if (!sr.moves.empty())
+    last_move = sr.moves.back();
+
+  /* parse pv of older records */
+  moves_t pv_moves = sr.pv_moves;
+  if (pv_moves.empty())
+    csaStringToMoves(sr.pv, state, pv_moves);
+  assert(!pv_moves.empty());
+
+  out << "score: " << sr.score << "\n" <<
+         stateToString(state, last_move) <<
+         "moves("<< sr.moves.size() << "): " <<
+                      osl::record::ki2::show(&*sr.moves.begin(), &*sr.moves.end(),
+                                             osl::NumEffectState()) << "\n" <<
+         "depth: " << sr.depth << "\n" <<
+         "secs:  " << sr.consumed_seconds << "\n" <<
+         "pv:    " << osl::record::ki2::show(&*pv_moves.begin(), &*pv_moves.end(),
+                                             osl::NumEffectState(state)) << "\n" <<
+         "at:    " << sr.timeString() <<
+         std::endl;
+}
+
+/**
+ * Render results [first, last) to out.
+ */
+void printPositions(const std::vector<SearchResult> *results, size_t first, size_t last,
+                    std::string *out)
+{
+  std::ostringstream oss;
+  for (size_t i=first; i<last; ++i) {
+    printPosition(oss, (*results)[i]);
+  }
+  *out = oss.str();
+}
+
+/**
+ * Read the whole results in the order of scores, batch_size at a time.
+ * Each batch is split into contiguous chunks rendered by threads, and the
+ * chunks are written in order.
+ */
+void dump_position(const std::vector<scored_id_t>& scores)
 {
   const std::string file_name = "position_" + the_player_str + ".csv";
   std::ofstream out(file_name.c_str(), std::ios_base::trunc);
@@ -91,78 +168,62 @@ void dump_position(const std::vector<SearchResult>& results, osl::Player player)
   LOG(INFO) << "Writing to " << file_name << "...";
   size_t missed = 0;
 
-  /* Rows */
-  BOOST_FOREACH(const SearchResult& sr, results) {
-    if (sr.depth < depth) {
-      missed += 1;
-      continue;
+  std::vector<SearchResult> results;
+  results.reserve(batch_size);
+  for (size_t i=0; i<scores.size(); i+=batch_size) {
+    results.clear();
+    for (size_t j=i; j<std::min(i+batch_size, scores.size()); ++j) {
+      results.push_back(SearchResult(scores[j].second));
     }
+    storage->querySearchResults(results);
+
+    std::vector<SearchResult> rows;
+    rows.reserve(results.size());
+    BOOST_FOREACH(SearchResult& sr, results) {
+      if (!isSearchedEnough(sr.depth, sr.settled, depth)) {
+        missed += 1; // overwritten after the scan
+        continue;
+      }
+      unmirrorSearchResult(sr);
+      rows.push_back(sr);
+    }
+
+    if (rows.empty())
+      continue;
 
-    const osl::SimpleState state = sr.board.getState();
-
-    osl::Move last_move;
-    if (!sr.moves.empty())
-      last_move = sr.moves.back();
-
-    /* parse pv */
-    std::vector<osl::Move> pv_moves;
-    {
-      osl::NumEffectState state(sr.board.getState());
-      for (size_t i=0; i<sr.pv.size(); ++i) {
-        if (sr.pv[i] == '+' || sr.pv[i] == '-' || sr.pv[i] == '%') {
-          for (size_t j=i+1; true; ++j) {
-            if (j == sr.pv.size() || sr.pv[j] == '+' || sr.pv[j] == '-' || sr.pv[j] == '%') {
-              const osl::Move move = osl::record::csa::strToMove(sr.pv.substr(i,(j-i)), state);
-              pv_moves.push_back(move);
-              state.makeMove(move);
-              i = j-1;
-              break;
-            }
-          } // for j
-        }
-      } // for i
+    /* Rows */
+    const size_t chunks = std::min((size_t)std::max(threads, 1), rows.size());
+    std::vector<std::string> buffers(chunks);
+    if (chunks == 1) {
+      printPositions(&rows, 0, rows.size(), &buffers[0]);
+    } else {
+      boost::thread_group workers;
+      for (size_t k=0; k<chunks; ++k) {
+        workers.create_thread(boost::bind(&printPositions, &rows,
+                                          rows.size()*k/chunks, rows.size()*(k+1)/chunks,
+                                          &buffers[k]));
+      }
+      workers.join_all();
     }
-    assert(!pv_moves.empty());
-
-    out << "score: " << sr.score << "\n" <<
-           stateToString(state, last_move) <<
-           "moves("<< sr.moves.size() << "): " <<
-                        osl::record::ki2::show(&*sr.moves.begin(), &*sr.moves.end(),
-                                               osl::NumEffectState()) << "\n" <<
-           "depth: " << sr.depth << "\n" <<
-           "secs:  " << sr.consumed_seconds << "\n" <<
-           "pv:    " << osl::record::ki2::show(&*pv_moves.begin(), &*pv_moves.end(),
-                                               osl::NumEffectState(state)) << "\n" <<
-           "at:    " << sr.timeString() <<
-           std::endl;
-  }  
+    BOOST_FOREACH(const std::string& buffer, buffers) {
+      out << buffer;
+    }
+  }
 
   LOG(INFO) << "  misses: " << missed;
 }
 
 void doMain()
 {
-  /* Retreive search results */
-  std::vector<SearchResult> results;
-  {
-    std::vector<osl::record::CompactBoard> boards;
-    getAllBoards(boards);
-    LOG(INFO) << "Loaded candidate boards: " << boards.size();
-
-    results.reserve(boards.size());
-    BOOST_FOREACH(const osl::record::CompactBoard& cb, boards) {
-      results.push_back(SearchResult(cb));
-    }
-    querySearchResult(c, results);
-  }
-
-  if (the_player_str == "black")
-    std::sort(results.begin(), results.end(), SearchResultCompare());
-  else
-    std::sort(results.rbegin(), results.rend(), SearchResultCompare());
-
-  dump_score(results, the_player);
-  dump_position(results, the_player);
+  /* Retreive scores, then whole results in order */
+  std::vector<scored_id_t> scores;
+  size_t missed;
+  ScoreStatistics statistics(bin_width);
+  scanScores(scores, missed, statistics);
+
+  dump_summary(statistics);
+  dump_score(scores, missed);
+  dump_position(scores);
 }
 
 void printUsage(std::ostream& out, 
@@ -177,10 +238,6 @@ void printUsage(std::ostream& out,
 
 int main(int argc, char **argv)
 {
-  std::string redis_server_host = "127.0.0.1";
-  int redis_server_port = 6379;
-  std::string redis_password;
-
   /* Set up logging */
   FLAGS_log_dir = ".";
   google::InitGoogleLogging(argv[0]);
@@ -190,13 +247,21 @@ int main(int argc, char **argv)
   command_line_options.add_options()
     ("depth", bp::value<int>(&depth)->default_value(depth),
      "depth to filter")
+    ("threads", bp::value<int>(&threads)->default_value(threads),
+     "number of threads to render positions")
+    ("batch-size", bp::value<size_t>(&batch_size)->default_value(batch_size),
+     "number of positions read per round trip")
+    ("bin-width", bp::value<int>(&bin_width)->default_value(bin_width),
+     "width of the bins of scores in the summary")
     ("player,p", bp::value<std::string>(&the_player_str)->default_value(the_player_str),
      "specify a player, black or white.")
-    ("redis-host", bp::value<std::string>(&redis_server_host)->default_value(redis_server_host),
+    ("local-storage", bp::value<std::string>(&storage_config.local_dir),
+     "directory of the local storage to use instead of the redis server")
+    ("redis-host", bp::value<std::string>(&storage_config.redis.host)->default_value(storage_config.redis.host),
      "IP of the redis server")
-    ("redis-password", bp::value<std::string>(&redis_password)->default_value(redis_password),
+    ("redis-password", bp::value<std::string>(&storage_config.redis.password)->default_value(storage_config.redis.password),
      "password to connect to the redis server")
-    ("redis-port", bp::value<int>(&redis_server_port)->default_value(redis_server_port),
+    ("redis-port", bp::value<int>(&storage_config.redis.port)->default_value(storage_config.redis.port),
      "port number of the redis server")
     ("help,h", "show this help message.");
   bp::positional_options_description p;
@@ -226,24 +291,17 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  batch_size = std::max(batch_size, (size_t)1);
+
   /* Connect to the Redis server */
-  connectRedisServer(&c, redis_server_host, redis_server_port);
-  if (!c) {
-    LOG(FATAL) << "Failed to connect to the Redis server";
-    exit(1);
-  }
-  if (!redis_password.empty()) {
-    if (!authenticate(c, redis_password)) {
-      LOG(FATAL) << "Failed to authenticate to the Redis server";
-      exit(1);
-    }
-  }
+  storage = openStorage(storage_config);
 
   /* MAIN */
   doMain();
+  logStorageStats(storage_config);
 
   /* Clean up things */
-  redisFree(c);
+  storage.reset();
   return 0;
 }
 // ;;; Local Variables:
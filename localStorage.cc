@@ -0,0 +1,889 @@
+#include "localStorage.h"
+#include "boardCodec.h"
+#include "workQueue.h"
+#include <glog/logging.h>
+#include <boost/foreach.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+  const char POSITIONS_MAGIC[8] = { 'G', 'P', 'S', 'P', 'O', 'S', '0', '5' };
+  const char QUEUE_MAGIC[8]     = { 'G', 'P', 'S', 'Q', 'U', 'E', '0', '4' };
+
+  /**
+   * bytes of records.dat per slot, reserved in a sparse file; a position
+   * takes a few hundred bytes, and more as its records are rewritten longer
+   */
+  const size_t RECORD_BYTES_PER_SLOT = 2048;
+  /** records are allocated in this unit, leaving room to grow in place */
+  const size_t RECORD_ALIGNMENT = 64;
+
+  /** bands of priorities, one per bit of information to reach a position */
+  const int BANDS = 16;
+  const int LEASE_RING = BANDS;
+  const int RINGS = BANDS + 1;
+  /** expired leases requeued per pop, as in workQueue.cc */
+  const int REAP_LIMIT = 16;
+  /**
+   * milliseconds after which a cell of a ring that a producer has not
+   * published, or a consumer has not freed, is skipped as left by a process
+   * that died
+   */
+  const long long STALL_MS = 10000;
+
+  const size_t ALIGNMENT = 4096;
+
+  enum { QUEUE_NONE = 0, QUEUE_QUEUED, QUEUE_LEASED };
+
+  size_t roundUp(size_t size, size_t unit)
+  {
+    return (size + unit - 1) / unit * unit;
+  }
+
+  uint32_t playerBit(osl::Player player)
+  {
+    return player == osl::BLACK ? 1 : 2;
+  }
+
+  int band(double priority)
+  {
+    return std::max(0, std::min((int)priority, BANDS - 1));
+  }
+
+  /** see LocalStorage::getLockWaits() */
+  uint64_t lock_waits = 0;
+
+  /**
+   * Make a mutex in a file shared among processes.  It is robust: when its
+   * owner dies, the next process locking it is told so and owns it.
+   */
+  void initSharedMutex(pthread_mutex_t& mutex)
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    const int ret = pthread_mutex_init(&mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (ret != 0) {
+      LOG(FATAL) << "Failed to make a mutex: " << strerror(ret);
+      exit(1);
+    }
+  }
+
+  /**
+   * A lock of a mutex made by initSharedMutex().  A mutex left locked by a
+   * process that died is taken over.
+   */
+  class RobustLock
+  {
+  public:
+    explicit RobustLock(pthread_mutex_t& mutex) : mutex(mutex), took_over(false)
+    {
+      int ret = pthread_mutex_trylock(&mutex);
+      if (ret == EBUSY) {
+        __sync_fetch_and_add(&lock_waits, 1);
+        ret = pthread_mutex_lock(&mutex);
+      }
+      if (ret == EOWNERDEAD) {
+        LOG(WARNING) << "Took over a lock of a dead process";
+        pthread_mutex_consistent(&mutex);
+        took_over = true;
+      } else if (ret != 0) {
+        LOG(FATAL) << "Failed to lock: " << strerror(ret);
+        exit(1);
+      }
+    }
+    ~RobustLock() { pthread_mutex_unlock(&mutex); }
+    bool tookOver() const { return took_over; }
+  private:
+    pthread_mutex_t& mutex;
+    bool took_over;
+  };
+
+  /**
+   * Map a file shared among processes, extending it to new_size bytes if
+   * it is empty.  The file stays locked until unlockFile() so that only one
+   * of the processes opening a new file initializes it.
+   */
+  char *mapFile(const std::string& path, size_t new_size, size_t& size, int& fd)
+  {
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+      LOG(FATAL) << "Failed to open " << path << ": " << strerror(errno);
+      exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      LOG(FATAL) << "Failed to stat " << path << ": " << strerror(errno);
+      exit(1);
+    }
+    size = st.st_size;
+    if (size == 0) {
+      if (ftruncate(fd, new_size) != 0) {
+        LOG(FATAL) << "Failed to extend " << path << ": " << strerror(errno);
+        exit(1);
+      }
+      size = new_size;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      LOG(FATAL) << "Failed to map " << path << ": " << strerror(errno);
+      exit(1);
+    }
+    return (char*)p;
+  }
+
+  void unlockFile(int fd)
+  {
+    flock(fd, LOCK_UN);
+    close(fd);
+  }
+} // anonymous namespace
+
+struct LocalStorage::Header
+{
+  char magic[8];
+  uint64_t capacity;               // slots, a power of 2
+  volatile uint64_t used;          // slots taken
+  volatile int64_t queued, leased;
+  volatile uint32_t notifications; // a futex counting notifyNewWork()
+  volatile uint32_t canonical;
+  uint64_t records_capacity;       // bytes of records.dat
+  volatile uint64_t records_used;  // bytes allocated from records.dat
+};
+
+/**
+ * A record of variable length in records.dat.  The bytes at the offset
+ * are reused while the record fits in them, and are leaked otherwise.
+ */
+struct LocalStorage::Record
+{
+  uint64_t offset;
+  uint32_t size;                   // 0 if empty
+  uint32_t capacity;               // bytes allocated at the offset
+};
+
+struct LocalStorage::Slot
+{
+  volatile uint64_t id;            // 0 if empty, set after the board
+  pthread_mutex_t lock;            // made with the file
+  uint32_t players;                // playerBit()s of the sets the position is in
+  uint32_t queue_state;
+  uint32_t lease_generation;
+  uint32_t mirrored;
+  int64_t lease_deadline;
+  double priority;
+  int32_t partial_depth, partial_score;
+  Record moves, result, partial_pv;
+  char board[COMPACT_BOARD_SIZE];
+};
+
+/**
+ * A cell of a ring, the bounded multi-producer multi-consumer queue of
+ * Dmitry Vyukov.  The sequence is stored relative to the index of the
+ * cell, so that the zero-filled cells of a new file are initialized.
+ */
+struct LocalStorage::Cell
+{
+  volatile int64_t sequence;
+  position_id_t id;
+  uint32_t generation;             // of the lease, in the lease ring
+  uint32_t padding;
+};
+
+struct LocalStorage::QueueHeader
+{
+  struct Ring
+  {
+    volatile uint64_t head;
+    char padding0[56];             // head and tail in separate cache lines
+    volatile uint64_t tail;
+    char padding1[56];
+  };
+  char magic[8];
+  uint64_t capacity;               // cells of a ring
+  volatile uint32_t lost_entries;  // counts events that may have lost entries
+  volatile uint32_t recovered_entries; // lost_entries when last recovered
+  pthread_mutex_t recovery_lock;   // made with the file
+  Ring rings[RINGS];
+};
+
+/**
+ * The lock of a slot.  A process that died holding it may have changed
+ * the state of the slot in the queue without pushing its entry, so the
+ * queue is recovered by the next pop then.
+ */
+class LocalStorage::SlotLock
+{
+public:
+  SlotLock(LocalStorage& storage, Slot& slot) : lock(slot.lock)
+  {
+    if (lock.tookOver())
+      __sync_fetch_and_add(&storage.queue->lost_entries, 1);
+  }
+private:
+  RobustLock lock;
+};
+
+
+LocalStorage::LocalStorage(const std::string& dir, size_t capacity)
+  : positions_map(NULL), queue_map(NULL), records_map(NULL),
+    positions_size(0), queue_size(0), records_size(0), header(NULL), slots(NULL), queue(NULL), cells(NULL), notifications(0),
+    stalls(RINGS * 2, std::make_pair((uint64_t)0, 0LL))
+{
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    LOG(FATAL) << "Failed to make " << dir << ": " << strerror(errno);
+    exit(1);
+  }
+
+  /* up to 7/8 of the slots are used */
+  uint64_t slot_count = 1024;
+  while (slot_count / 8 * 7 < capacity)
+    slot_count *= 2;
+
+  int fd;
+  const size_t header_size = roundUp(sizeof(Header), ALIGNMENT);
+  positions_map = mapFile(dir + "/positions.dat",
+                          header_size + slot_count * sizeof(Slot),
+                          positions_size, fd);
+  header = (Header*)positions_map;
+  slots = (Slot*)(positions_map + header_size);
+  if (header->capacity == 0) {
+    /* a creator that died before the capacity is set leaves it to the next */
+    memcpy(header->magic, POSITIONS_MAGIC, sizeof(header->magic));
+    for (uint64_t i = 0; i < slot_count; ++i)
+      initSharedMutex(slots[i].lock);
+    header->capacity = slot_count;
+    header->records_capacity = slot_count * RECORD_BYTES_PER_SLOT;
+  }
+  if (memcmp(header->magic, POSITIONS_MAGIC, sizeof(header->magic)) != 0
+      || positions_size < header_size + header->capacity * sizeof(Slot)) {
+    LOG(FATAL) << "Broken positions in " << dir;
+    exit(1);
+  }
+  unlockFile(fd);
+
+  records_map = mapFile(dir + "/records.dat", header->records_capacity,
+                        records_size, fd);
+  if (records_size < header->records_capacity) {
+    LOG(FATAL) << "Broken records in " << dir;
+    exit(1);
+  }
+  unlockFile(fd);
+
+  const size_t queue_header_size = roundUp(sizeof(QueueHeader), ALIGNMENT);
+  queue_map = mapFile(dir + "/queue.dat",
+                      queue_header_size + RINGS * header->capacity * sizeof(Cell),
+                      queue_size, fd);
+  queue = (QueueHeader*)queue_map;
+  if (queue->capacity == 0) {
+    memcpy(queue->magic, QUEUE_MAGIC, sizeof(queue->magic));
+    initSharedMutex(queue->recovery_lock);
+    queue->capacity = header->capacity;
+  }
+  if (memcmp(queue->magic, QUEUE_MAGIC, sizeof(queue->magic)) != 0
+      || queue->capacity != header->capacity
+      || queue_size < queue_header_size + RINGS * queue->capacity * sizeof(Cell)) {
+    LOG(FATAL) << "Broken queue in " << dir;
+    exit(1);
+  }
+  cells = (Cell*)(queue_map + queue_header_size);
+  unlockFile(fd);
+}
+
+LocalStorage::~LocalStorage()
+{
+  munmap(records_map, records_size);
+  munmap(queue_map, queue_size);
+  munmap(positions_map, positions_size);
+}
+
+void LocalStorage::writeRecord(Record& record, const char *data, size_t size)
+{
+  record.size = 0;
+  __sync_synchronize();
+  if (size > record.capacity) {
+    const uint64_t bytes = roundUp(size, RECORD_ALIGNMENT);
+    const uint64_t offset = __sync_fetch_and_add(&header->records_used, bytes);
+    if (offset + bytes > header->records_capacity) {
+      LOG(FATAL) << "The records of the local storage are full: " << offset << " bytes";
+      exit(1);
+    }
+    record.offset = offset;
+    record.capacity = bytes;
+  }
+  memcpy(records_map + record.offset, data, size);
+  __sync_synchronize();
+  record.size = size;
+}
+
+const char *LocalStorage::recordData(const Record& record) const
+{
+  return records_map + record.offset;
+}
+
+LocalStorage::Slot *LocalStorage::findSlot(position_id_t id)
+{
+  if (id == 0)
+    return NULL;
+  const uint64_t mask = header->capacity - 1;
+  for (uint64_t i=0; i<=mask; ++i) {
+    Slot& slot = slots[(id + i) & mask];
+    const uint64_t slot_id = slot.id;
+    if (slot_id == 0)
+      return NULL;
+    if (slot_id == id) {
+      __sync_synchronize();
+      return &slot;
+    }
+  }
+  return NULL;
+}
+
+LocalStorage::Slot& LocalStorage::resolve(const std::string& board, position_id_t& id)
+{
+  assert(board.size() == COMPACT_BOARD_SIZE);
+  const uint64_t mask = header->capacity - 1;
+  id = compactBoardHash(board);
+  while (true) {
+    if (id == 0)
+      id = 1; // 0 marks empty slots
+
+    Slot *slot = NULL;
+    for (uint64_t i=0; i<=mask && !slot; ++i) {
+      Slot& each = slots[(id + i) & mask];
+      if (each.id == 0) {
+        if (header->used >= header->capacity / 8 * 7) {
+          LOG(FATAL) << "The local storage is full: " << header->used << " positions";
+          exit(1);
+        }
+        SlotLock lock(*this, each);
+        if (each.id == 0) {
+          /* a process dying before publishing the id leaves the slot empty */
+          memcpy(each.board, board.data(), board.size());
+          __sync_synchronize();
+          each.id = id;
+          __sync_fetch_and_add(&header->used, 1);
+          return each;
+        }
+      }
+      if (each.id == id)
+        slot = &each;
+    }
+    assert(slot);
+
+    __sync_synchronize();
+    if (memcmp(slot->board, board.data(), board.size()) == 0)
+      return *slot;
+    LOG(WARNING) << "Position id collision: " << id;
+    id += 1;
+  }
+}
+
+bool LocalStorage::stalled(int ring, bool popping, uint64_t pos)
+{
+  std::pair<uint64_t, long long>& stall = stalls[ring * 2 + popping];
+  const long long now = leaseDeadline(0);
+  if (stall.second == 0 || stall.first != pos) {
+    stall = std::make_pair(pos, now);
+    return false;
+  }
+  return now - stall.second >= STALL_MS;
+}
+
+/**
+ * A producer that dies between taking a cell and publishing it, or a
+ * consumer between taking a cell and freeing it, would stop the ring.
+ * Such a cell is skipped after STALL_MS, and its entry is recovered by
+ * recoverQueue().  A slow process that finds its cell skipped retries.
+ */
+void LocalStorage::push(int ring, position_id_t id, uint32_t generation)
+{
+  QueueHeader::Ring& r = queue->rings[ring];
+  const uint64_t capacity = queue->capacity, mask = capacity - 1;
+  Cell *ring_cells = cells + ring * capacity;
+  while (true) {
+    uint64_t pos = r.tail;
+    Cell *cell;
+    while (true) {
+      cell = &ring_cells[pos & mask];
+      const int64_t offset = pos & mask;
+      const int64_t diff = cell->sequence + offset - (int64_t)pos;
+      if (diff == 0) {
+        if (__sync_bool_compare_and_swap(&r.tail, pos, pos + 1))
+          break;
+      } else if (diff < 0) {
+        if (r.head + capacity <= pos) {
+          LOG(FATAL) << "The work queue is full";
+          exit(1);
+        }
+        /* a consumer has taken the cell but not freed it yet */
+        if (stalled(ring, false, pos)) {
+          if (__sync_bool_compare_and_swap(&cell->sequence,
+                                           (int64_t)(pos - capacity + 1) - offset,
+                                           (int64_t)pos - offset)) {
+            LOG(WARNING) << "Freed a cell of a dead consumer: " << ring;
+            __sync_fetch_and_add(&queue->lost_entries, 1);
+          }
+          continue;
+        }
+        sched_yield();
+      }
+      pos = r.tail;
+    }
+    cell->id = id;
+    cell->generation = generation;
+    __sync_synchronize();
+    const int64_t offset = pos & mask;
+    if (__sync_bool_compare_and_swap(&cell->sequence, (int64_t)pos - offset,
+                                     (int64_t)(pos + 1) - offset))
+      return;
+    LOG(WARNING) << "Lost a cell skipped as stalled: " << ring;
+  }
+}
+
+bool LocalStorage::pop(int ring, position_id_t& id, uint32_t& generation)
+{
+  QueueHeader::Ring& r = queue->rings[ring];
+  const uint64_t capacity = queue->capacity, mask = capacity - 1;
+  Cell *ring_cells = cells + ring * capacity;
+  while (true) {
+    uint64_t pos = r.head;
+    Cell *cell;
+    while (true) {
+      cell = &ring_cells[pos & mask];
+      const int64_t offset = pos & mask;
+      const int64_t diff = cell->sequence + offset - (int64_t)(pos + 1);
+      if (diff == 0) {
+        if (__sync_bool_compare_and_swap(&r.head, pos, pos + 1))
+          break;
+      } else if (diff < 0) {
+        if (r.tail == pos)
+          return false; // empty
+        /* a producer has taken the cell but not published it yet */
+        if (!stalled(ring, true, pos))
+          return false;
+        if (__sync_bool_compare_and_swap(&cell->sequence, (int64_t)pos - offset,
+                                         (int64_t)(pos + capacity) - offset)) {
+          LOG(WARNING) << "Skipped a cell of a dead producer: " << ring;
+          __sync_fetch_and_add(&queue->lost_entries, 1);
+          __sync_bool_compare_and_swap(&r.head, pos, pos + 1);
+        }
+      } else if (diff == (int64_t)capacity - 1) {
+        /* freed; move the head if the consumer skipping it died */
+        __sync_bool_compare_and_swap(&r.head, pos, pos + 1);
+      }
+      pos = r.head;
+    }
+    __sync_synchronize();
+    id = cell->id;
+    generation = cell->generation;
+    __sync_synchronize();
+    const int64_t offset = pos & mask;
+    if (__sync_bool_compare_and_swap(&cell->sequence, (int64_t)(pos + 1) - offset,
+                                     (int64_t)(pos + capacity) - offset))
+      return true;
+    LOG(WARNING) << "Lost a cell skipped as stalled: " << ring;
+  }
+}
+
+void LocalStorage::enqueue(Slot& slot)
+{
+  assert(slot.queue_state == QUEUE_NONE);
+  slot.queue_state = QUEUE_QUEUED;
+  __sync_fetch_and_add(&header->queued, 1);
+  push(band(slot.priority), slot.id, 0);
+}
+
+void LocalStorage::lease(Slot& slot, long long deadline)
+{
+  assert(slot.queue_state == QUEUE_QUEUED);
+  slot.queue_state = QUEUE_LEASED;
+  slot.lease_deadline = deadline;
+  slot.lease_generation += 1;
+  __sync_fetch_and_sub(&header->queued, 1);
+  __sync_fetch_and_add(&header->leased, 1);
+  push(LEASE_RING, slot.id, slot.lease_generation);
+}
+
+void LocalStorage::requeue(Slot& slot)
+{
+  assert(slot.queue_state == QUEUE_LEASED);
+  slot.queue_state = QUEUE_QUEUED;
+  __sync_fetch_and_sub(&header->leased, 1);
+  __sync_fetch_and_add(&header->queued, 1);
+  push(band(slot.priority), slot.id, 0);
+}
+
+/**
+ * Leases are in the lease ring in the order they were taken.  Renewed
+ * leases are put back to the tail; entries of leases released or taken
+ * again are dropped.
+ */
+void LocalStorage::reapLeases(long long now)
+{
+  int requeued = 0;
+  for (int i=0; i<REAP_LIMIT; ++i) {
+    position_id_t id;
+    uint32_t generation;
+    if (!pop(LEASE_RING, id, generation))
+      break;
+    Slot *slot = findSlot(id);
+    if (!slot)
+      continue;
+    SlotLock lock(*this, *slot);
+    if (slot->queue_state != QUEUE_LEASED || slot->lease_generation != generation)
+      continue;
+    if (slot->lease_deadline > now)
+      push(LEASE_RING, id, generation);
+    else {
+      requeue(*slot);
+      ++requeued;
+    }
+  }
+  if (requeued)
+    notifyNewWork();
+}
+
+/**
+ * Push the entries of positions again if they are missing from the rings.
+ * Entries pushed twice are dropped when popped, as those of positions
+ * claimed.  The counters of the queue are left as they are.
+ */
+void LocalStorage::recoverQueue()
+{
+  RobustLock lock(queue->recovery_lock);
+  const uint32_t lost = queue->lost_entries;
+  if (lost == queue->recovered_entries)
+    return; // by another process
+
+  /* (id, generation) of the entries; the generation is 0 in the bands */
+  std::vector<std::pair<position_id_t, uint32_t> > entries;
+  const uint64_t mask = queue->capacity - 1;
+  for (int ring=0; ring<RINGS; ++ring) {
+    const QueueHeader::Ring& r = queue->rings[ring];
+    const Cell *ring_cells = cells + ring * queue->capacity;
+    const uint64_t head = r.head, tail = r.tail;
+    for (uint64_t pos=head; pos!=tail && pos-head<=mask; ++pos) {
+      const Cell& cell = ring_cells[pos & mask];
+      entries.push_back(std::make_pair(cell.id, ring == LEASE_RING ? cell.generation : 0));
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+
+  size_t pushed = 0;
+  for (uint64_t i=0; i<header->capacity; ++i) {
+    Slot& slot = slots[i];
+    if (slot.id == 0)
+      continue;
+    SlotLock slot_lock(*this, slot);
+    if (slot.queue_state == QUEUE_QUEUED
+        && !std::binary_search(entries.begin(), entries.end(),
+                               std::make_pair((position_id_t)slot.id, (uint32_t)0))) {
+      push(band(slot.priority), slot.id, 0);
+      ++pushed;
+    } else if (slot.queue_state == QUEUE_LEASED
+               && !std::binary_search(entries.begin(), entries.end(),
+                                      std::make_pair((position_id_t)slot.id,
+                                                     slot.lease_generation))) {
+      push(LEASE_RING, slot.id, slot.lease_generation);
+      ++pushed;
+    }
+  }
+  queue->recovered_entries = lost;
+  LOG(WARNING) << "Recovered entries of the work queue: " << pushed;
+}
+
+
+void LocalStorage::reset(osl::Player player, bool canonical)
+{
+  const uint32_t bit = playerBit(player);
+  for (uint64_t i=0; i<header->capacity; ++i) {
+    Slot& slot = slots[i];
+    if (slot.id == 0 || !(slot.players & bit))
+      continue;
+    SlotLock lock(*this, slot);
+    slot.players &= ~bit;
+  }
+  header->canonical = canonical;
+}
+
+uint64_t LocalStorage::getLockWaits()
+{
+  return lock_waits;
+}
+
+bool LocalStorage::isCanonicalMode()
+{
+  return header->canonical;
+}
+
+size_t LocalStorage::appendPositions(osl::Player player,
+                                     const std::vector<PositionEntry>& positions,
+                                     int min_depth)
+{
+  size_t queued = 0;
+  BOOST_FOREACH(const PositionEntry& position, positions) {
+    position_id_t id;
+    Slot& slot = resolve(position.board, id);
+    SlotLock lock(*this, slot);
+    slot.players |= playerBit(player);
+    slot.mirrored = position.mirrored;
+    writeRecord(slot.moves, position.moves.data(), position.moves.size());
+
+    int depth = -1, score;
+    bool settled = false;
+    if (slot.result.size)
+      peekSearchResult(recordData(slot.result), slot.result.size, depth, score, &settled);
+    if (min_depth > 0 && isSearchedEnough(depth, settled, min_depth))
+      continue;
+    if (slot.queue_state == QUEUE_LEASED)
+      continue; // being searched by a client
+    ++queued;
+    if (slot.queue_state == QUEUE_NONE) {
+      slot.priority = position.priority;
+      enqueue(slot);
+    }
+  }
+  if (queued)
+    notifyNewWork();
+  return queued;
+}
+
+int LocalStorage::popPositions(long long deadline, size_t count,
+                               std::vector<position_id_t>& ids)
+{
+  if (queue->lost_entries != queue->recovered_entries)
+    recoverQueue();
+  reapLeases(leaseDeadline(0));
+
+  ids.clear();
+  for (int b=0; b<BANDS && ids.size()<count; ++b) {
+    position_id_t id;
+    uint32_t generation;
+    while (ids.size() < count && pop(b, id, generation)) {
+      Slot *slot = findSlot(id);
+      if (!slot)
+        continue;
+      SlotLock lock(*this, *slot);
+      if (slot->queue_state != QUEUE_QUEUED)
+        continue; // claimed or popped through another entry
+      lease(*slot, deadline);
+      ids.push_back(id);
+    }
+  }
+  return ids.empty() ? 1 : 0;
+}
+
+int LocalStorage::claimPosition(long long deadline, position_id_t id)
+{
+  Slot *slot = findSlot(id);
+  if (!slot)
+    return 1;
+  SlotLock lock(*this, *slot);
+  if (slot->queue_state != QUEUE_QUEUED)
+    return 1;
+  lease(*slot, deadline); // the entry left in the band is dropped when popped
+  return 0;
+}
+
+size_t LocalStorage::renewLeases(long long deadline, const std::vector<position_id_t>& ids)
+{
+  size_t lost = 0;
+  BOOST_FOREACH(const position_id_t id, ids) {
+    Slot *slot = findSlot(id);
+    if (slot) {
+      SlotLock lock(*this, *slot);
+      if (slot->queue_state == QUEUE_LEASED) {
+        slot->lease_deadline = deadline;
+        continue;
+      }
+    }
+    LOG(WARNING) << "Lost the lease: " << id;
+    ++lost;
+  }
+  return lost;
+}
+
+void LocalStorage::releaseLeases(const std::vector<position_id_t>& ids)
+{
+  BOOST_FOREACH(const position_id_t id, ids) {
+    Slot *slot = findSlot(id);
+    if (!slot)
+      continue;
+    SlotLock lock(*this, *slot);
+    if (slot->queue_state != QUEUE_LEASED)
+      continue;
+    slot->queue_state = QUEUE_NONE;
+    __sync_fetch_and_sub(&header->leased, 1);
+  }
+}
+
+void LocalStorage::requeueLeases(const std::vector<position_id_t>& ids)
+{
+  int requeued = 0;
+  BOOST_FOREACH(const position_id_t id, ids) {
+    Slot *slot = findSlot(id);
+    if (!slot)
+      continue;
+    SlotLock lock(*this, *slot);
+    if (slot->queue_state == QUEUE_LEASED) {
+      requeue(*slot);
+      ++requeued;
+    }
+  }
+  if (requeued)
+    notifyNewWork();
+}
+
+int LocalStorage::getQueueLength()
+{
+  return (int)(header->queued + header->leased);
+}
+
+void LocalStorage::subscribeNewWork()
+{
+  notifications = header->notifications;
+}
+
+/**
+ * The futex is shared among processes, as the mapping is, so the private
+ * operations are not used.
+ */
+void LocalStorage::notifyNewWork()
+{
+  __sync_fetch_and_add(&header->notifications, 1);
+  syscall(SYS_futex, &header->notifications, FUTEX_WAKE, INT_MAX,
+          NULL, NULL, 0);
+}
+
+int LocalStorage::waitForNewWork(int timeout_ms)
+{
+  const long long deadline = leaseDeadline(0) + timeout_ms;
+  while (true) {
+    const uint32_t current = header->notifications;
+    if (current != notifications) {
+      notifications = current;
+      return 0;
+    }
+    const long long rest = deadline - leaseDeadline(0);
+    if (rest <= 0)
+      return 1;
+    struct timespec timeout;
+    timeout.tv_sec = rest / 1000;
+    timeout.tv_nsec = rest % 1000 * 1000000;
+    /* returns at once with EAGAIN if notified since read */
+    if (syscall(SYS_futex, &header->notifications, FUTEX_WAIT, current,
+                &timeout, NULL, 0) != 0
+        && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+      LOG(FATAL) << "Failed to wait for new work: " << strerror(errno);
+      exit(1);
+    }
+  }
+}
+
+void LocalStorage::querySearchResults(std::vector<SearchResult>& results,
+                                      std::vector<int> *found)
+{
+  if (found)
+    found->assign(results.size(), 0);
+
+  std::string board, moves, record;
+  for (size_t i=0; i<results.size(); ++i) {
+    SearchResult& sr = results[i];
+    Slot *slot = findSlot(sr.id);
+    if (!slot)
+      continue;
+    {
+      /* copy, then decode without the lock */
+      SlotLock lock(*this, *slot);
+      board.assign(slot->board, COMPACT_BOARD_SIZE);
+      moves.assign(recordData(slot->moves), slot->moves.size);
+      record.assign(recordData(slot->result), slot->result.size);
+      sr.mirrored = slot->mirrored;
+      sr.partial_depth = slot->partial_depth;
+      sr.partial_score = slot->partial_score;
+      sr.partial_pv.assign(recordData(slot->partial_pv), slot->partial_pv.size);
+    }
+    if (decodeCompactBoard(board.data(), board.size(), sr.board))
+      LOG(WARNING) << "broken board: " << sr.id;
+    decodeMoves(moves.data(), moves.size(), sr.moves);
+    if (!record.empty() && decodeSearchResult(record.data(), record.size(), sr))
+      LOG(WARNING) << "broken search result: " << sr.id;
+    if (found)
+      (*found)[i] = 1;
+  }
+}
+
+void LocalStorage::setResults(const std::vector<SearchResult>& results)
+{
+  BOOST_FOREACH(const SearchResult& sr, results) {
+    const std::string record = encodeSearchResult(sr);
+    Slot *slot = findSlot(sr.id);
+    if (!slot) {
+      LOG(WARNING) << "Position not found: " << sr.id;
+      continue;
+    }
+    SlotLock lock(*this, *slot);
+    writeRecord(slot->result, record.data(), record.size());
+    slot->partial_depth = slot->partial_score = 0;
+    slot->partial_pv.size = 0; // its bytes are reused by the next checkpoint
+  }
+}
+
+void LocalStorage::setCheckpoint(position_id_t id, int depth, int score,
+                                 const std::string& pv)
+{
+  Slot *slot = findSlot(id);
+  if (!slot)
+    return;
+  SlotLock lock(*this, *slot);
+  slot->partial_depth = 0; // no checkpoint if the process dies while writing
+  writeRecord(slot->partial_pv, pv.data(), pv.size());
+  slot->partial_score = score;
+  __sync_synchronize();
+  slot->partial_depth = depth;
+}
+
+void LocalStorage::scanPositions(osl::Player player, const visitor_t& visit)
+{
+  const uint32_t bit = playerBit(player);
+  size_t scanned = 0;
+  for (uint64_t i=0; i<header->capacity; ++i) {
+    Slot& slot = slots[i];
+    if (slot.id == 0 || !(slot.players & bit))
+      continue;
+    position_id_t id;
+    int depth = -1, score = 0;
+    bool settled = false;
+    {
+      SlotLock lock(*this, slot);
+      id = slot.id;
+      if (slot.result.size)
+        peekSearchResult(recordData(slot.result), slot.result.size, depth, score, &settled);
+    }
+    visit(id, depth, score, settled);
+    ++scanned;
+  }
+  LOG(INFO) << "Scanned boards: " << scanned;
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -0,0 +1,124 @@
+#ifndef _GPS_LOCAL_STORAGE_H
+#define _GPS_LOCAL_STORAGE_H
+
+#include "storage.h"
+#include <stdint.h>
+
+/**
+ * Storage in three files of a directory mapped to memory and shared by the
+ * processes of a host, so that a campaign on a single host needs neither
+ * the network nor a server, and the results persist on disk.
+ *   positions.dat  a hash table of positions by id with open addressing.
+ *                  A slot holds the board, the checkpoint, the state of the
+ *                  position in the work queue and the places of its
+ *                  records in records.dat, guarded by a robust mutex of
+ *                  the slot shared among the processes.
+ *   records.dat    the moves, the result record (see encodeSearchResult())
+ *                  and the principal variation of the checkpoint of each
+ *                  position, of any length, allocated one after another.
+ *   queue.dat      the work queue: lock-free bounded rings of ids, one per
+ *                  band of priorities (see queuePriority()) served in
+ *                  order, and a ring of leases to find the expired ones.
+ * The capacity is fixed when the files are created.  A process may be
+ * killed at any point: the mutex of a dead owner is taken over by the
+ * next process locking it, records are never left torn, and entries of
+ * the queue lost with a process are pushed again.
+ */
+class LocalStorage : public Storage
+{
+public:
+  /**
+   * @param capacity positions that new files can hold
+   */
+  LocalStorage(const std::string& dir, size_t capacity);
+  ~LocalStorage();
+
+  void reset(osl::Player player, bool canonical);
+  bool isCanonicalMode();
+  size_t appendPositions(osl::Player player,
+                         const std::vector<PositionEntry>& positions,
+                         int min_depth);
+
+  int popPositions(long long deadline, size_t count,
+                   std::vector<position_id_t>& ids);
+  int claimPosition(long long deadline, position_id_t id);
+  size_t renewLeases(long long deadline, const std::vector<position_id_t>& ids);
+  void releaseLeases(const std::vector<position_id_t>& ids);
+  void requeueLeases(const std::vector<position_id_t>& ids);
+  int getQueueLength();
+  /**
+   * waitForNewWork() blocks on a futex in positions.dat, woken when
+   * positions are queued by appendPositions(), requeueLeases() or the
+   * reaping of expired leases.
+   */
+  void subscribeNewWork();
+  int waitForNewWork(int timeout_ms);
+
+  void querySearchResults(std::vector<SearchResult>& results,
+                          std::vector<int> *found=NULL);
+  void setResults(const std::vector<SearchResult>& results);
+  void setCheckpoint(position_id_t id, int depth, int score, const std::string& pv);
+  void scanPositions(osl::Player player, const visitor_t& visit);
+
+  /**
+   * Times that threads of this process blocked on a lock of a slot held
+   * by another thread or process, a measure of contention.
+   */
+  static uint64_t getLockWaits();
+private:
+  LocalStorage(const LocalStorage&);
+  LocalStorage& operator=(const LocalStorage&);
+
+  struct Header;
+  struct Record;
+  struct Slot;
+  struct QueueHeader;
+  struct Cell;
+  class SlotLock;
+  friend class SlotLock;
+
+  Slot *findSlot(position_id_t id);
+  /**
+   * Find the slot of a board, inserting the board if missing.
+   * @param id set to the id of the board
+   */
+  Slot& resolve(const std::string& board, position_id_t& id);
+
+  /** the following are called with the slot locked */
+  /**
+   * Copy a record so that the slot keeps either the old record or an
+   * empty one, never a torn one, if the process dies while copying.
+   */
+  void writeRecord(Record& record, const char *data, size_t size);
+  const char *recordData(const Record& record) const;
+  void enqueue(Slot& slot);
+  void lease(Slot& slot, long long deadline);
+  void requeue(Slot& slot);
+
+  /**
+   * Whether the cell at pos has stayed untouched for STALL_MS, measured
+   * from the first of consecutive calls for the pos.
+   */
+  bool stalled(int ring, bool popping, uint64_t pos);
+  void push(int ring, position_id_t id, uint32_t generation);
+  bool pop(int ring, position_id_t& id, uint32_t& generation);
+  void reapLeases(long long now);
+  void notifyNewWork();
+  void recoverQueue();
+
+  char *positions_map, *queue_map, *records_map;
+  size_t positions_size, queue_size, records_size;
+  Header *header;
+  Slot *slots;
+  QueueHeader *queue;
+  Cell *cells;
+  uint32_t notifications; // seen by waitForNewWork()
+  /** (pos, since) of the cell last found stalled, by ring and direction */
+  std::vector<std::pair<uint64_t, long long> > stalls;
+};
+
+#endif /* _GPS_LOCAL_STORAGE_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
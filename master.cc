@@ -1,5 +1,10 @@
+#include "bookIndex.h"
+#include "bookTraversal.h"
+#include "positionKey.h"
 #include "redis.h"
 #include "searchResult.h"
+#include "storage.h"
+#include "workQueue.h"
 #include "osl/move.h"
 #include "osl/eval/pieceEval.h"
 #include "osl/hash/hashKey.h"
@@ -14,13 +19,12 @@
 #include "osl/search/simpleHashTable.h"
 #include "osl/state/numEffectState.h"
 #include "osl/stl/vector.h"
-#include <hiredis/hiredis.h>
 #include <glog/logging.h>
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <boost/program_options.hpp>
 #include <boost/shared_ptr.hpp>
-#include <deque>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -29,113 +33,95 @@
 namespace bp = boost::program_options;
 bp::variables_map vm;
 
-redisContext *c = NULL;
-
-typedef std::vector<osl::record::opening::WMove> WMoveContainer;
+boost::shared_ptr<Storage> storage;
 
 osl::Player the_player = osl::BLACK;
 int is_determinate = 0;	   // test only top n moves.  0 for all
 int max_depth, non_determinate_depth;
 double ratio;		   // use moves[n+1] when the weight[n+1] >= ratio*weight[n]
+size_t batch_size;	   // positions sent to the server per round trip
+int threads;		   // threads to traverse the book
+std::string index_file;	   // made by buildIndex
+bool incremental;	   // queue only positions not yet searched to min_depth
+int min_depth;
+bool canonical;		   // a position and its mirror share the key
 
+StorageConfig storage_config;
 
-struct Node
-{
-  typedef osl::stl::vector<osl::Move> moves_t;
-
-  int state_index;
-  std::string state_key;
-  moves_t moves;
-
-  Node(int _state_index,
-       const std::string& _state_key)
-    : state_index(_state_index),
-      state_key(_state_key)
-  {}
-
-  Node(int _state_index,
-       const std::string& _state_key,
-       const moves_t& _moves)
-    : state_index(_state_index),
-      state_key(_state_key),
-      moves(_moves)
-  {}
-
-  // depth-1手目からdepth手目のstate。depth手目はまだ指されていない（これか
-  // らdepth手目）
-  int getDepth() const {
-    return moves.size() + 1;
-  }
-};
 
-const Node nextNode(const Node current_node,
-                    int next_state_index,
-                    const std::string& next_state_str,
-                    const osl::Move move) {
-  moves_t moves = current_node.moves;
-  moves.push_back(move);
-  return Node(next_state_index, next_state_str, moves);
+const std::string getMovesStr(const moves_t& moves) {
+  return encodeMoves(moves);
 }
 
 
-const std::string getStateKey(const osl::SimpleState& state) {
-  const osl::record::CompactBoard cb(state);
-  return compactBoardToString(cb);
-}
-
-const std::string getMovesStr(const Node::moves_t& moves) {
-  std::ostringstream ss;
-  BOOST_FOREACH(const osl::Move move, moves) {
-    osl::record::writeInt(ss, move.intValue());
+/**
+ * Appends positions to the storage, batch_size positions at a time.
+ * If min_depth is positive, positions whose existing results are already
+ * searched enough for min_depth (see isSearchedEnough()) are not added to
+ * the queue.
+ * If canonical, positions are keyed by canonicalBoardString(), so that a
+ * position and its mirror are searched once.
+ */
+class PositionWriter : public PositionSink
+{
+public:
+  PositionWriter(Storage& _storage, osl::Player _player, size_t _batch_size,
+                 int _min_depth=0, bool _canonical=false)
+    : storage(_storage),
+      player(_player),
+      batch_size(std::max(_batch_size, (size_t)1)),
+      min_depth(_min_depth),
+      canonical(_canonical),
+      written(0), queued(0)
+  {
+    positions.reserve(batch_size);
   }
-  return ss.str();
-}
-
 
-void setupServer(osl::Player player) {
-  std::string key;
-  if (player == osl::BLACK) {
-    key = "DEL tag:black-positions";
-  } else {
-    key = "DEL tag:white-positions";
+  ~PositionWriter() {
+    flush();
   }
-  assert(!key.empty());
-  redisReplyPtr reply((redisReply*)redisCommand(c, key.c_str()),
-                      freeRedisReply);
-  if (checkRedisReply(reply))
-    exit(1);
-}
-
 
-bool isFinished(const std::string& state_key) {
-  redisReplyPtr reply((redisReply*)redisCommand(c, "EXISTS %b",
-                                                state_key.c_str(), state_key.size()),
-                      freeRedisReply);
-  if (checkRedisReply(reply))
-    exit(1);
-
-  const bool ret = (reply->integer == 1L);
-  return ret;
-}
-
-
-int appendPosition(osl::Player player, const Node& node) {
-  const std::string state_key = node.state_key;
-  const std::string moves_str = getMovesStr(node.moves);
-
-  redisAppendCommand(c, "SADD %s %b", "tag:new-queue", state_key.c_str(), state_key.size());
-  
-  if (player == osl::BLACK) {
-    redisAppendCommand(c, "SADD %s %b", "tag:black-positions", state_key.c_str(), state_key.size());
-  } else {
-    redisAppendCommand(c, "SADD %s %b", "tag:white-positions", state_key.c_str(), state_key.size());
+  void append(const std::string& state_key, const moves_t& moves,
+              double reach) {
+    PositionEntry position;
+    if (canonical) {
+      osl::SimpleState state;
+      if (decodeCompactBoard(state_key.data(), state_key.size(), state))
+        LOG(FATAL) << "broken board";
+      position.board = canonicalBoardString(state, position.mirrored);
+    } else {
+      position.board = state_key;
+    }
+    position.moves = getMovesStr(moves);
+    position.priority = queuePriority(moves.size() + 1, reach);
+    positions.push_back(position);
+    if (positions.size() >= batch_size)
+      flush();
   }
 
-  redisAppendCommand(c, "HMSET %b moves %b",
-                     state_key.c_str(), state_key.size(),
-                     moves_str.c_str(), moves_str.size());
+  void flush();
+
+  size_t getWritten() const { return written; }
+  size_t getQueued() const { return queued; }
+private:
+  Storage& storage;
+  const osl::Player player;
+  const size_t batch_size;
+  const int min_depth;
+  const bool canonical;
+  size_t written, queued;
+  std::vector<PositionEntry> positions;
+};
+
+void PositionWriter::flush()
+{
+  if (positions.empty())
+    return;
 
-  return 3; // two commands
+  queued  += storage.appendPositions(player, positions, min_depth);
+  written += positions.size();
+  DLOG(INFO) << "Written positions: " << written << " queued: " << queued;
+  positions.clear();
 }
 
 
@@ -150,114 +136,65 @@ void printUsage(std::ostream& out,
 
 
 void doMain(const std::string& file_name) {
-  LOG(INFO) << boost::format("Opening... %s") % file_name;
-  osl::record::opening::WeightedBook book(file_name.c_str());
-
-  LOG(INFO) << boost::format("Total states: %d") % book.getTotalState();
-  bool states[book.getTotalState()]; // mark states that have been visited.
-  memset(states, 0, sizeof(states));
-
-  setupServer(the_player);
-
-  std::vector<Node> stateToVisit;
-
-  LOG(INFO) << boost::format("Start index: %d") % book.getStartState();
-  const Node root_node(book.getStartState(),
-                       getStateKey(book.getBoard(book.getStartState())));
-  stateToVisit.push_back(root_node);
+  /* Each thread has its own book, storage and writer */
+  std::vector<boost::shared_ptr<BookSource> > books;
+  std::vector<boost::shared_ptr<Storage> > storages;
+  std::vector<boost::shared_ptr<PositionWriter> > writers;
+
+  boost::shared_ptr<BookIndex> index;
+  if (!index_file.empty()) {
+    LOG(INFO) << boost::format("Opening... %s") % index_file;
+    index.reset(new BookIndex);
+    if (index->open(index_file, file_name)) {
+      LOG(WARNING) << "Ignore the index and read the book";
+      index.reset();
+    }
+  }
 
-  typedef std::pair<int, int> eval_depth_t;
-  std::deque<eval_depth_t> evals;
+  for (int i=0; i<std::max(threads, 1); ++i) {
+    if (index) {
+      // shared among threads since it is read only
+      books.push_back(index);
+    } else {
+      LOG(INFO) << boost::format("Opening... %s") % file_name;
+      books.push_back(boost::shared_ptr<BookSource>(new WeightedBookSource(file_name)));
+    }
+    storages.push_back(i == 0 ? storage : openStorage(storage_config));
+    writers.push_back(boost::shared_ptr<PositionWriter>(
+      new PositionWriter(*storages.back(), the_player, batch_size,
+                         incremental ? min_depth : 0, canonical)));
+  }
 
-  /* Append positions to the server in the pipelined mode */
-  int counter = 0;
+  LOG(INFO) << boost::format("Total states: %d") % books.front()->getTotalState();
 
-  while (!stateToVisit.empty()) {
-    const Node node = stateToVisit.back();
-    DLOG(INFO) << boost::format("Visiting... %d") % node.state_index;
-    stateToVisit.pop_back();
-    states[node.state_index] = true;
+  storage->reset(the_player, canonical);
 
-    /* この局面を処理する */
-    const osl::SimpleState state(book.getBoard(node.state_index));
-    if (state.turn() == osl::alt(the_player)) {
-      // 黒の定跡を評価したい -> 黒の手が指されたあとの局面
-      //                      -> 白手番の局面をサーバに登録する
-      counter += appendPosition(the_player, node);
-    }
+  TraversalConfig config;
+  config.player                = the_player;
+  config.is_determinate        = is_determinate;
+  config.non_determinate_depth = non_determinate_depth;
+  config.max_depth             = max_depth;
+  config.ratio                 = ratio;
 
-    WMoveContainer moves = book.getMoves(node.state_index);
-    std::sort(moves.begin(), moves.end(), osl::record::opening::WMoveSort());
-
-    /*
-     * 自分（the_player）の手番では、有望な手(weight>0)のみ抽出する
-     * 相手はどんな手を指すか分からないので、特にfilterせずに、そのまま。
-     */
-    if (!moves.empty() && state.turn() == the_player) {
-      int min = 1;
-      if (is_determinate) {
-	min = moves.at(0).getWeight();
-	if (node.getDepth() <= non_determinate_depth) {
-	  for (int i=1; i<=std::min(is_determinate, (int)moves.size()-1); ++i) {
-	    const int weight = moves.at(i).getWeight();
-	    if ((double)weight < (double)moves.at(i-1).getWeight()*ratio)
-	      break;
-	    min = weight;
-	  }
-	}
-      }
-      // Do not play 0-weighted moves.
-      if (min == 0) min = 1;
-
-      WMoveContainer::iterator each = moves.begin();
-      for (; each != moves.end(); ++each) {
-        if (each->getWeight() < min)
-          break;
-      }
-      moves.erase(each, moves.end());
-    }
-    DLOG(INFO) << boost::format("  #moves... %d\n") % moves.size();
-    
-    /* leaf nodes */
-    if (moves.empty() || node.getDepth() > max_depth) {
-      continue;
-    }
+  std::vector<BookSource*> book_ptrs;
+  std::vector<PositionSink*> sinks;
+  for (size_t i=0; i<books.size(); ++i) {
+    book_ptrs.push_back(books[i].get());
+    sinks.push_back(writers[i].get());
+  }
+  traverseBook(book_ptrs, config, sinks);
 
-    // recursively search the tree
-    for (std::vector<osl::record::opening::WMove>::const_iterator each = moves.begin();
-         each != moves.end(); ++each) {
-      // consistancy check
-      const osl::hash::HashKey hash(state);
-      const int nextIndex = each->getStateIndex();
-      const osl::SimpleState next_state(book.getBoard(nextIndex));
-      const osl::hash::HashKey next_hash(next_state);
-      const osl::hash::HashKey moved_hash = hash.newMakeMove(each->getMove());
-      if (moved_hash != next_hash)
-        throw std::string("Illegal move found.");
-
-      if (!states[nextIndex]) {
-	stateToVisit.push_back(nextNode(node,
-                                        nextIndex,
-                                        getStateKey(next_state),
-                                        each->getMove()));
-      }
-    } // each wmove
-  } // while loop
-
-  /* check results */
-  LOG(INFO) << "Checking processed positions...: " << counter/3;
-  for (int i=0; i<counter; ++i) {
-    void *r;
-    redisGetReply(c, &r);
-    redisReplyPtr reply((redisReply*)r, freeRedisReply);
-    if (i % 3 != 2) {
-      assert(reply->type == REDIS_REPLY_INTEGER);
-      assert(0 <= reply->integer);
-      assert(reply->integer < 2);
-    } else {
-      checkRedisReply(reply);
-    }
+  size_t written = 0, queued = 0;
+  BOOST_FOREACH(const boost::shared_ptr<PositionWriter>& writer, writers) {
+    writer->flush();
+    written += writer->getWritten();
+    queued  += writer->getQueued();
   }
+  LOG(INFO) << "Processed positions: " << written;
+  LOG(INFO) << "Queued positions: " << queued;
+
+  writers.clear();
+  logStorageStats(storage_config);
 }
 
 
@@ -265,10 +202,6 @@ int main(int argc, char **argv)
 {
   std::string player_str;
   std::string file_name;
-  std::string redis_server_host = "127.0.0.1";
-  int redis_server_port = 6379;
-  std::string redis_password;
-
   /* Set up logging */
   FLAGS_log_dir = ".";
   google::InitGoogleLogging(argv[0]);
@@ -280,20 +213,40 @@ int main(int argc, char **argv)
      "default black.")
     ("input-file,f", bp::value<std::string>(&file_name)->default_value("./joseki.dat"),
      "a joseki file to validate.")
+    ("index", bp::value<std::string>(&index_file)->default_value(""),
+     "an index of the joseki file made by buildIndex.  "
+     "the joseki file is read if the index is missing or out of date.")
     ("determinate", bp::value<int>(&is_determinate)->default_value(0),
      "only search the top n moves.  (0 for all,  1 for determinate).")
     ("non-determinate-depth", bp::value<int>(&non_determinate_depth)->default_value(100),
      "use the best move where the depth is greater than this value")
     ("max-depth", bp::value<int>(&max_depth)->default_value(100),
      "do not go beyond this depth from the root")
-    ("redis-host", bp::value<std::string>(&redis_server_host)->default_value(redis_server_host),
+    ("local-storage", bp::value<std::string>(&storage_config.local_dir),
+     "directory of the local storage to use instead of the redis server")
+    ("local-capacity", bp::value<size_t>(&storage_config.local_capacity)->default_value(0),
+     "positions that a new local storage can hold.  0 for the states of the book")
+    ("redis-host", bp::value<std::string>(&storage_config.redis.host)->default_value(storage_config.redis.host),
      "IP of the redis server")
-    ("redis-password", bp::value<std::string>(&redis_password)->default_value(redis_password),
+    ("redis-password", bp::value<std::string>(&storage_config.redis.password)->default_value(storage_config.redis.password),
      "password to connect to the redis server")
-    ("redis-port", bp::value<int>(&redis_server_port)->default_value(redis_server_port),
+    ("redis-port", bp::value<int>(&storage_config.redis.port)->default_value(storage_config.redis.port),
      "port number of the redis server")
+    ("redis-retry-seconds", bp::value<int>(&storage_config.redis.retry_seconds)->default_value(storage_config.redis.retry_seconds),
+     "seconds to keep trying to connect again when the connection is lost")
     ("ratio", bp::value<double>(&ratio)->default_value(0.0),
      "skip move[i] (i >= n), if weight[n] < weight[n-1]*ratio")
+    ("batch-size", bp::value<size_t>(&batch_size)->default_value(1000),
+     "number of positions sent to the redis server per round trip")
+    ("threads", bp::value<int>(&threads)->default_value(1),
+     "number of threads to traverse the book, each with its own connection")
+    ("incremental", bp::bool_switch(&incremental),
+     "queue only positions whose results are missing or shallower than --min-depth, "
+     "unless settled by the time manager of client")
+    ("min-depth", bp::value<int>(&min_depth)->default_value(0),
+     "depth that a result needs to be skipped in the incremental mode")
+    ("canonical", bp::bool_switch(&canonical),
+     "key a position and its horizontal mirror by the same board")
     ("verbose,v", "output verbose messages.")
     ("help,h", "show this help message.");
   bp::positional_options_description p;
@@ -324,21 +277,21 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  connectRedisServer(&c, redis_server_host, redis_server_port);
-  if (!c) {
-    LOG(FATAL) << "Failed to connect to the Redis server";
-    exit(1);
+  if (incremental && min_depth <= 0) {
+    std::cerr << "--incremental requires a positive --min-depth" << std::endl;
+    printUsage(std::cerr, argv, command_line_options);
+    return 1;
   }
-  if (!redis_password.empty()) {
-    if (!authenticate(c, redis_password)) {
-      LOG(FATAL) << "Failed to authenticate to the Redis server";
-      exit(1);
-    }
+
+  if (!storage_config.local_dir.empty() && storage_config.local_capacity == 0) {
+    /* a position is a state of the book, whichever player it is of */
+    storage_config.local_capacity = WeightedBookSource(file_name).getTotalState();
   }
+  storage = openStorage(storage_config);
 
   doMain(file_name);
 
-  redisFree(c);
+  storage.reset();
   return 0;
 }
 // ;;; Local Variables:
@@ -0,0 +1,220 @@
+#include "positionKey.h"
+#include "redis.h"
+#include "searchResult.h"
+#include <hiredis/hiredis.h>
+#include <glog/logging.h>
+#include <boost/foreach.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <cassert>
+
+/**
+ * Converts the data of the old key schema, where positions are keyed by
+ * their CompactBoard strings, to the key schema v2 (see positionKey.h).
+ * Clients and master must not be running during the migration.
+ */
+
+/**
+ * Global variables
+ */
+
+namespace bp = boost::program_options;
+bp::variables_map vm;
+
+RedisConnection *c = NULL;
+size_t batch_size = 1000;
+bool delete_old = false;
+
+typedef std::map<std::string, position_id_t> migrated_t;
+
+/**
+ * Functions
+ */
+
+/**
+ * Copy the hashes of old boards to the hashes of their ids.
+ */
+void migrateBoards(const std::vector<std::string>& boards, migrated_t& migrated)
+{
+  std::vector<position_id_t> ids;
+  if (resolvePositionIds(*c, boards, ids))
+    exit(1);
+
+  RedisPipeline pipeline(*c);
+  BOOST_FOREACH(const std::string& board, boards) {
+    pipeline.add("HGETALL") << board;
+  }
+  std::vector<redisReplyPtr> replies;
+  pipeline.execute(replies);
+
+  for (size_t i=0; i<boards.size(); ++i) {
+    const redisReply *reply = replies[i].get();
+    assert(reply->type == REDIS_REPLY_ARRAY);
+    migrated[boards[i]] = ids[i];
+    if (reply->elements == 0)
+      continue;
+
+    RedisCommand& hmset = pipeline.add("HMSET") << positionKey(ids[i]);
+    for (size_t j=0; j<reply->elements; ++j) {
+      const redisReply *r = reply->element[j];
+      hmset << std::string(r->str, r->len);
+    }
+  }
+  std::vector<redisReplyPtr> written;
+  pipeline.execute(written);
+}
+
+/**
+ * Rewrite a set of old boards as a set of ids.
+ */
+void migrateSet(const std::string& set_key, migrated_t& migrated)
+{
+  redisReplyPtr type = c->execute(RedisCommand("TYPE") << set_key);
+  if (std::string(type->str) != "set") {
+    LOG(INFO) << set_key << ": skipped (" << type->str << ")";
+    return;
+  }
+
+  redisReplyPtr reply = c->execute(RedisCommand("SMEMBERS") << set_key);
+  assert(reply->type == REDIS_REPLY_ARRAY);
+
+  std::vector<std::string> members;
+  std::vector<std::string> boards;
+  bool has_old = false;
+  for (size_t i=0; i<reply->elements; ++i) {
+    const redisReply *r = reply->element[i];
+    assert(r->type == REDIS_REPLY_STRING);
+    if (r->len == 8) {
+      members.push_back(std::string(r->str, r->len)); // already migrated
+      continue;
+    }
+    assert(r->len == 41*4);
+    has_old = true;
+    const std::string board(r->str, r->len);
+    if (migrated.find(board) == migrated.end())
+      boards.push_back(board);
+    members.push_back(board);
+  }
+  LOG(INFO) << set_key << ": " << members.size() << " members, "
+            << boards.size() << " boards to migrate";
+  if (!has_old)
+    return;
+
+  for (size_t i=0; i<boards.size(); i+=batch_size) {
+    const std::vector<std::string> batch(boards.begin()+i,
+                                         boards.begin()+std::min(i+batch_size, boards.size()));
+    migrateBoards(batch, migrated);
+  }
+
+  const std::string tmp_key = set_key + ":migrating";
+  c->execute(RedisCommand("DEL") << tmp_key);
+  for (size_t i=0; i<members.size(); i+=batch_size) {
+    RedisCommand sadd("SADD");
+    sadd << tmp_key;
+    for (size_t j=i; j<std::min(i+batch_size, members.size()); ++j) {
+      if (members[j].size() == 8)
+        sadd << members[j];
+      else
+        sadd << positionIdToMember(migrated[members[j]]);
+    }
+    c->execute(sadd);
+  }
+  if (!members.empty())
+    c->execute(RedisCommand("RENAME") << tmp_key << set_key);
+}
+
+void doMain()
+{
+  const char *sets[] = {
+    "tag:black-positions", "tag:white-positions", "tag:new-queue"
+  };
+
+  migrated_t migrated;
+  for (size_t i=0; i<sizeof(sets)/sizeof(sets[0]); ++i) {
+    migrateSet(sets[i], migrated);
+  }
+  LOG(INFO) << "Migrated boards: " << migrated.size();
+
+  if (delete_old) {
+    RedisPipeline pipeline(*c);
+    std::vector<redisReplyPtr> replies;
+    for (migrated_t::const_iterator each = migrated.begin();
+         each != migrated.end(); ++each) {
+      pipeline.add("DEL") << each->first;
+      if (pipeline.size() == batch_size)
+        pipeline.execute(replies);
+    }
+    pipeline.execute(replies);
+    LOG(INFO) << "Deleted old keys";
+  }
+}
+
+void printUsage(std::ostream& out,
+                char **argv,
+                const boost::program_options::options_description& command_line_options)
+{
+  out <<
+    "Usage: " << argv[0] << " [options]\n"
+      << command_line_options
+      << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  RedisConfig redis_config;
+
+  /* Set up logging */
+  FLAGS_log_dir = ".";
+  google::InitGoogleLogging(argv[0]);
+
+  /* Parse command line options */
+  bp::options_description command_line_options;
+  command_line_options.add_options()
+    ("batch-size", bp::value<size_t>(&batch_size)->default_value(batch_size),
+     "number of positions migrated per round trip")
+    ("delete-old", bp::bool_switch(&delete_old),
+     "delete the hashes keyed by boards after the migration")
+    ("redis-host", bp::value<std::string>(&redis_config.host)->default_value(redis_config.host),
+     "IP of the redis server")
+    ("redis-password", bp::value<std::string>(&redis_config.password)->default_value(redis_config.password),
+     "password to connect to the redis server")
+    ("redis-port", bp::value<int>(&redis_config.port)->default_value(redis_config.port),
+     "port number of the redis server")
+    ("help,h", "show this help message.");
+  bp::positional_options_description p;
+
+  try {
+    bp::store(
+      bp::command_line_parser(
+	argc, argv).options(command_line_options).positional(p).run(), vm);
+    bp::notify(vm);
+    if (vm.count("help")) {
+      printUsage(std::cout, argv, command_line_options);
+      return 0;
+    }
+  } catch (std::exception &e) {
+    std::cerr << "error in parsing options\n"
+	      << e.what() << std::endl;
+    printUsage(std::cerr, argv, command_line_options);
+    return 1;
+  }
+  batch_size = std::max(batch_size, (size_t)1);
+
+  /* Connect to the Redis server */
+  c = new RedisConnection(redis_config);
+
+  /* MAIN */
+  doMain();
+
+  /* Clean up things */
+  delete c;
+  return 0;
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -0,0 +1,119 @@
+#include "positionKey.h"
+#include "redis.h"
+#include "searchResult.h"
+#include <hiredis/hiredis.h>
+#include <glog/logging.h>
+#include <boost/lexical_cast.hpp>
+#include <cassert>
+#include <cstdlib>
+
+const std::string positionIdToMember(position_id_t id)
+{
+  char buf[8];
+  for (int i=7; i>=0; --i) {
+    buf[i] = static_cast<char>(id & 0xff);
+    id >>= 8;
+  }
+  return std::string(buf, sizeof(buf));
+}
+
+position_id_t memberToPositionId(const char *str, size_t len)
+{
+  assert(len == 8);
+  position_id_t id = 0;
+  for (size_t i=0; i<len; ++i) {
+    id = (id << 8) | static_cast<unsigned char>(str[i]);
+  }
+  return id;
+}
+
+const std::string positionKey(position_id_t id)
+{
+  return "p:" + positionIdToMember(id);
+}
+
+namespace
+{
+  const char *const CANONICAL_KEY = "tag:canonical";
+}
+
+bool isCanonicalMode(RedisConnection& c)
+{
+  redisReplyPtr reply = c.execute(RedisCommand("EXISTS") << CANONICAL_KEY);
+  assert(reply->type == REDIS_REPLY_INTEGER);
+  return reply->integer == 1;
+}
+
+void setCanonicalMode(RedisConnection& c, bool canonical)
+{
+  if (canonical)
+    c.execute(RedisCommand("SET") << CANONICAL_KEY << 1);
+  else
+    c.execute(RedisCommand("DEL") << CANONICAL_KEY);
+}
+
+
+int resolvePositionIds(RedisConnection& c,
+                       const std::vector<std::string>& boards,
+                       std::vector<position_id_t>& ids,
+                       std::vector<int> *depths,
+                       std::vector<int> *settled)
+{
+  ids.resize(boards.size());
+  if (depths)
+    depths->assign(boards.size(), -1);
+  if (settled)
+    settled->assign(boards.size(), 0);
+
+  std::vector<size_t> pending, collided;
+  for (size_t i=0; i<boards.size(); ++i) {
+    ids[i] = compactBoardHash(boards[i]);
+    pending.push_back(i);
+  }
+
+  RedisPipeline pipeline(c);
+  std::vector<redisReplyPtr> replies;
+  while (!pending.empty()) {
+    for (size_t j=0; j<pending.size(); ++j) {
+      const size_t i = pending[j];
+      const std::string key = positionKey(ids[i]);
+      pipeline.add("HSETNX") << key << "board" << boards[i];
+      pipeline.add("HMGET") << key << "board" << "depth" << "result";
+    }
+    pipeline.execute(replies);
+
+    collided.clear();
+    for (size_t j=0; j<pending.size(); ++j) {
+      const size_t i = pending[j];
+      const redisReply *reply = replies[2*j+1].get();
+      assert(reply->type == REDIS_REPLY_ARRAY && reply->elements == 3);
+      const redisReply *board = reply->element[0];
+      assert(board->type == REDIS_REPLY_STRING);
+      if (boards[i].compare(0, std::string::npos, board->str, board->len) != 0) {
+        LOG(WARNING) << "Position id collision: " << ids[i];
+        ids[i] += 1;
+        collided.push_back(i);
+        continue;
+      }
+      if (!depths)
+        continue;
+      const redisReply *depth = reply->element[1];
+      const redisReply *result = reply->element[2];
+      int score;
+      bool is_settled = false;
+      if (result->type == REDIS_REPLY_STRING) {
+        peekSearchResult(result->str, result->len, (*depths)[i], score, &is_settled);
+        if (settled)
+          (*settled)[i] = is_settled;
+      } else if (depth->type == REDIS_REPLY_STRING) {
+        (*depths)[i] = boost::lexical_cast<int>(std::string(depth->str, depth->len));
+      }
+    }
+    pending.swap(collided);
+  }
+  return 0;
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -0,0 +1,57 @@
+#ifndef _GPS_POSITION_KEY_H
+#define _GPS_POSITION_KEY_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * Key schema v2.
+ *
+ * A position is identified by a 64-bit id, which is compactBoardHash() of
+ * its board, or the next free value if that is taken by another board.
+ *   - tag:new-queue, tag:<player>-positions
+ *       sets of 8-byte ids (big endian)
+ *   - p:<id>
+ *       a hash holding the board (CompactBoard), moves and search results
+ *   - tag:canonical
+ *       exists if boards are canonicalized (see canonicalBoardString())
+ */
+typedef uint64_t position_id_t;
+
+const std::string positionIdToMember(position_id_t id);
+position_id_t memberToPositionId(const char *str, size_t len);
+
+/**
+ * Key of the hash of a position.
+ */
+const std::string positionKey(position_id_t id);
+
+class RedisConnection; // forward declaration
+
+/**
+ * Whether master keys positions by the canonical boards.
+ */
+bool isCanonicalMode(RedisConnection& c);
+void setCanonicalMode(RedisConnection& c, bool canonical);
+
+/**
+ * Find the ids of boards, registering each board to the hash of its id if
+ * the hash does not exist yet.  Ids are resolved in a pipeline; collisions
+ * are resolved by probing the following ids.
+ * If depths is not NULL, it is set to the depths of existing results, or
+ * -1 for positions not searched yet, and settled to 1 for the results
+ * settled by the time manager (see SearchResult::settled).
+ * @return 0 on success
+ */
+int resolvePositionIds(RedisConnection& c,
+                       const std::vector<std::string>& boards,
+                       std::vector<position_id_t>& ids,
+                       std::vector<int> *depths=NULL,
+                       std::vector<int> *settled=NULL);
+
+#endif /* _GPS_POSITION_KEY_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
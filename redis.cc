@@ -1,27 +1,63 @@
 #include "redis.h"
+#include <hiredis/async.h>
 #include <glog/logging.h>
+#include <boost/foreach.hpp>
+#include <algorithm>
+#include <iomanip>
 #include <iostream>
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <poll.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 void connectRedisServer(redisContext **context, const std::string& host, const int port) {
   const struct timeval timeout = { 1, 500000 }; // 1.5 seconds
   redisContext *c = redisConnectWithTimeout(host.c_str(), port, timeout);
-  if (c->err) {
+  if (!c) {
+    std::cerr << "Connection error: can't allocate redis context" << std::endl;
+  } else if (c->err) {
     std::cerr << "Connection error: " << c->errstr << std::endl;
+    redisFree(c);
   } else {
     *context = c;
   }
 }
 
-bool authenticate(redisContext *c, const std::string& password) {
-  redisReplyPtr reply((redisReply*)redisCommand(c, "AUTH %s", password.c_str()),
-                      freeRedisReply);
-  if (checkRedisReply(reply))
-    exit(1);
-  assert(reply->type == REDIS_REPLY_STATUS);
-  const std::string ret(reply->str);
-  DLOG(INFO) << "authenticated: " << ret;
-  return "OK" == ret;
+namespace
+{
+  /**
+   * Whether an error reply of AUTH refuses the password, rather than
+   * telling that the server is not ready, e.g. LOADING while starting.
+   */
+  bool isPasswordRefused(const std::string& message)
+  {
+    return message.find("WRONGPASS") != std::string::npos
+      || message.find("invalid") != std::string::npos
+      || message.find("no password") != std::string::npos;
+  }
+} // anonymous namespace
+
+int authenticate(redisContext *c, const std::string& password) {
+  redisReply *r = (redisReply*)redisCommand(c, "AUTH %s", password.c_str());
+  if (!r) {
+    LOG(WARNING) << "Lost the connection to the Redis server: " << c->errstr;
+    return 1;
+  }
+  redisReplyPtr reply(r, freeRedisReply);
+  if (reply->type == REDIS_REPLY_STATUS && std::string(reply->str) == "OK") {
+    DLOG(INFO) << "authenticated";
+    return 0;
+  }
+  const std::string message = reply->str ? reply->str : "";
+  LOG(ERROR) << "AUTH: " << message;
+  if (reply->type == REDIS_REPLY_ERROR && !isPasswordRefused(message))
+    return 1;
+  return -1;
 }
 
 
@@ -40,3 +76,428 @@ int checkRedisReply(const redisReplyPtr& reply) {
   return 0;
 }
 
+namespace
+{
+  /** timeout of a round trip, after which the connection is considered lost */
+  const int COMMAND_TIMEOUT_SECONDS = 30;
+  /** the longest wait between attempts to connect */
+  const int MAX_RETRY_INTERVAL_MS = 10000;
+
+  double now()
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+
+  template <class T>
+  const std::string format(const char *spec, T value)
+  {
+    char buf[32];
+    snprintf(buf, sizeof(buf), spec, value);
+    return buf;
+  }
+} // anonymous namespace
+
+
+RedisCommand& RedisCommand::operator<<(int arg)
+{
+  args.push_back(format("%d", arg));
+  return *this;
+}
+
+RedisCommand& RedisCommand::operator<<(size_t arg)
+{
+  args.push_back(format("%lu", (unsigned long)arg));
+  return *this;
+}
+
+RedisCommand& RedisCommand::operator<<(long long arg)
+{
+  args.push_back(format("%lld", arg));
+  return *this;
+}
+
+RedisCommand& RedisCommand::operator<<(double arg)
+{
+  args.push_back(format("%.17g", arg));
+  return *this;
+}
+
+
+RedisStats& RedisStats::instance()
+{
+  static RedisStats stats;
+  return stats;
+}
+
+void RedisStats::record(const std::string& name, size_t commands, double seconds)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  Counter& counter = counters[name];
+  counter.commands += commands;
+  counter.round_trips += 1;
+  counter.total_seconds += seconds;
+  counter.max_seconds = std::max(counter.max_seconds, seconds);
+}
+
+size_t RedisStats::getCommands() const
+{
+  boost::mutex::scoped_lock lock(mutex);
+  size_t commands = 0;
+  for (std::map<std::string, Counter>::const_iterator each = counters.begin();
+       each != counters.end(); ++each) {
+    commands += each->second.commands;
+  }
+  return commands;
+}
+
+void RedisStats::write(std::ostream& out) const
+{
+  boost::mutex::scoped_lock lock(mutex);
+  out << std::setw(16) << std::left << "command" << std::right
+      << std::setw(10) << "commands"
+      << std::setw(12) << "round trips"
+      << std::setw(10) << "mean ms"
+      << std::setw(10) << "max ms" << "\n";
+  for (std::map<std::string, Counter>::const_iterator each = counters.begin();
+       each != counters.end(); ++each) {
+    const Counter& counter = each->second;
+    out << std::setw(16) << std::left << each->first << std::right
+        << std::setw(10) << counter.commands
+        << std::setw(12) << counter.round_trips
+        << std::fixed << std::setprecision(2)
+        << std::setw(10) << counter.total_seconds * 1000 / counter.round_trips
+        << std::setw(10) << counter.max_seconds * 1000 << "\n";
+  }
+}
+
+std::ostream& operator<<(std::ostream& out, const RedisStats& stats)
+{
+  stats.write(out);
+  return out;
+}
+
+
+RedisConnection::RedisConnection(const RedisConfig& _config)
+  : config(_config), c(NULL)
+{
+  connect();
+}
+
+RedisConnection::~RedisConnection()
+{
+  if (c)
+    redisFree(c);
+}
+
+void RedisConnection::connect()
+{
+  const time_t give_up = time(NULL) + config.retry_seconds;
+  int interval_ms = 100;
+  while (true) {
+    if (c) {
+      redisFree(c);
+      c = NULL;
+    }
+    connectRedisServer(&c, config.host, config.port);
+    if (c) {
+      const struct timeval timeout = { COMMAND_TIMEOUT_SECONDS, 0 };
+      redisSetTimeout(c, timeout);
+      const int auth = config.password.empty() ? 0 : authenticate(c, config.password);
+      if (auth < 0) {
+        LOG(FATAL) << "Failed to authenticate to the Redis server";
+        exit(1);
+      }
+      if (auth == 0) {
+        if (channels.empty())
+          return;
+        std::vector<RedisCommand> commands;
+        BOOST_FOREACH(const std::string& channel, channels) {
+          commands.push_back(RedisCommand("SUBSCRIBE") << channel);
+        }
+        std::vector<redisReplyPtr> replies;
+        if (roundTrip(commands, replies) == 0)
+          return;
+      }
+    }
+    if (time(NULL) >= give_up) {
+      LOG(FATAL) << "Failed to connect to the Redis server";
+      exit(1);
+    }
+    LOG(WARNING) << "Connecting to the Redis server again in " << interval_ms << " ms";
+    usleep(interval_ms * 1000);
+    interval_ms = std::min(interval_ms * 2, MAX_RETRY_INTERVAL_MS);
+  }
+}
+
+int RedisConnection::roundTrip(const std::vector<RedisCommand>& commands,
+                               std::vector<redisReplyPtr>& replies)
+{
+  std::vector<const char*> argv;
+  std::vector<size_t> argvlen;
+  BOOST_FOREACH(const RedisCommand& command, commands) {
+    argv.clear();
+    argvlen.clear();
+    BOOST_FOREACH(const std::string& arg, command.arguments()) {
+      argv.push_back(arg.data());
+      argvlen.push_back(arg.size());
+    }
+    if (redisAppendCommandArgv(c, (int)argv.size(), &argv[0], &argvlen[0]) != REDIS_OK) {
+      LOG(FATAL) << "Failed to append a command: " << c->errstr;
+      exit(1);
+    }
+  }
+
+  replies.resize(commands.size());
+  for (size_t i=0; i<commands.size(); ++i) {
+    void *r;
+    if (redisGetReply(c, &r) != REDIS_OK) {
+      LOG(WARNING) << "Lost the connection to the Redis server: " << c->errstr;
+      return 1;
+    }
+    replies[i].reset((redisReply*)r, freeRedisReply);
+  }
+  return 0;
+}
+
+redisReplyPtr RedisConnection::execute(const RedisCommand& command)
+{
+  std::vector<redisReplyPtr> replies;
+  execute(std::vector<RedisCommand>(1, command), replies);
+  return replies[0];
+}
+
+void RedisConnection::execute(const std::vector<RedisCommand>& commands,
+                              std::vector<redisReplyPtr>& replies)
+{
+  replies.clear();
+  if (commands.empty())
+    return;
+
+  double start = now();
+  while (roundTrip(commands, replies)) {
+    connect();
+    start = now();
+  }
+  const double seconds = now() - start;
+
+  std::map<std::string, size_t> names;
+  BOOST_FOREACH(const RedisCommand& command, commands) {
+    ++names[command.name()];
+  }
+  for (std::map<std::string, size_t>::const_iterator each = names.begin();
+       each != names.end(); ++each) {
+    RedisStats::instance().record(each->first, each->second, seconds);
+  }
+
+  BOOST_FOREACH(const redisReplyPtr& reply, replies) {
+    if (checkRedisReply(reply))
+      exit(1);
+  }
+}
+
+void RedisConnection::subscribe(const std::string& channel)
+{
+  channels.push_back(channel);
+  execute(RedisCommand("SUBSCRIBE") << channel);
+}
+
+int RedisConnection::waitForMessage(int timeout_ms)
+{
+  assert(!channels.empty());
+  bool received = false;
+  while (true) {
+    void *r = NULL;
+    if (redisGetReplyFromReader(c, &r) != REDIS_OK)
+      break;
+    if (r) {
+      freeReplyObject(r);
+      received = true;
+      continue;
+    }
+    if (received)
+      return 0;
+
+    struct pollfd fds;
+    fds.fd = c->fd;
+    fds.events = POLLIN;
+    fds.revents = 0;
+    const int ret = poll(&fds, 1, timeout_ms);
+    if (ret <= 0)
+      return 1; // timed out or interrupted
+    if (redisBufferRead(c) != REDIS_OK)
+      break;
+  }
+
+  /* messages may have been lost while reconnecting */
+  LOG(WARNING) << "Lost the connection to the Redis server: " << c->errstr;
+  connect();
+  return 0;
+}
+
+
+void RedisPipeline::execute(std::vector<redisReplyPtr>& replies)
+{
+  c.execute(commands, replies);
+  commands.clear();
+}
+
+
+struct RedisAsyncConnection::Request
+{
+  RedisAsyncConnection *connection;
+  callback_t callback;
+  std::string name;
+  double start;
+};
+
+RedisAsyncConnection::RedisAsyncConnection(const RedisConfig& config)
+  : ac(NULL), reading(false), writing(false), failed(false), in_flight(0)
+{
+  ac = redisAsyncConnect(config.host.c_str(), config.port);
+  if (!ac || ac->err) {
+    /* run() reports the failure, so that the caller retries */
+    LOG(WARNING) << "Failed to connect to the Redis server: "
+                 << (ac ? ac->errstr : "can't allocate redis context");
+    if (ac)
+      redisAsyncFree(ac);
+    ac = NULL;
+    failed = true;
+    return;
+  }
+  ac->data = this;
+  ac->ev.data = this;
+  ac->ev.addRead = addRead;
+  ac->ev.delRead = delRead;
+  ac->ev.addWrite = addWrite;
+  ac->ev.delWrite = delWrite;
+  ac->ev.cleanup = cleanup;
+  redisAsyncSetDisconnectCallback(ac, onDisconnect);
+
+  if (!config.password.empty())
+    send(RedisCommand("AUTH") << config.password, callback_t());
+}
+
+RedisAsyncConnection::~RedisAsyncConnection()
+{
+  if (ac) {
+    redisAsyncContext *dying = ac;
+    ac = NULL;
+    redisAsyncFree(dying); // calls the pending callbacks with NULL
+  }
+}
+
+void RedisAsyncConnection::addRead(void *data)
+{
+  ((RedisAsyncConnection*)data)->reading = true;
+}
+
+void RedisAsyncConnection::delRead(void *data)
+{
+  ((RedisAsyncConnection*)data)->reading = false;
+}
+
+void RedisAsyncConnection::addWrite(void *data)
+{
+  ((RedisAsyncConnection*)data)->writing = true;
+}
+
+void RedisAsyncConnection::delWrite(void *data)
+{
+  ((RedisAsyncConnection*)data)->writing = false;
+}
+
+void RedisAsyncConnection::cleanup(void *data)
+{
+  RedisAsyncConnection *self = (RedisAsyncConnection*)data;
+  self->reading = self->writing = false;
+}
+
+void RedisAsyncConnection::onDisconnect(const redisAsyncContext *ac, int status)
+{
+  RedisAsyncConnection *self = (RedisAsyncConnection*)ac->data;
+  self->ac = NULL; // freed by hiredis
+  if (status != REDIS_OK) {
+    LOG(WARNING) << "Lost the connection to the Redis server: " << ac->errstr;
+    self->failed = true;
+  }
+}
+
+void RedisAsyncConnection::onReply(redisAsyncContext *, void *r, void *privdata)
+{
+  Request *request = (Request*)privdata;
+  redisReply *reply = (redisReply*)r;
+  --request->connection->in_flight;
+  if (reply) {
+    RedisStats::instance().record(request->name, 1, now() - request->start);
+    if (reply->type == REDIS_REPLY_ERROR) {
+      if (request->name == "AUTH" && !isPasswordRefused(reply->str)) {
+        LOG(WARNING) << "AUTH: " << reply->str;
+        request->connection->failed = true;
+      } else {
+        LOG(FATAL) << reply->str;
+        exit(1);
+      }
+    }
+  } else {
+    request->connection->failed = true;
+  }
+  if (request->callback)
+    request->callback(reply);
+  delete request;
+}
+
+void RedisAsyncConnection::send(const RedisCommand& command, const callback_t& callback)
+{
+  Request *request = new Request;
+  request->connection = this;
+  request->callback = callback;
+  request->name = command.name();
+  request->start = now();
+  ++in_flight;
+
+  std::vector<const char*> argv;
+  std::vector<size_t> argvlen;
+  BOOST_FOREACH(const std::string& arg, command.arguments()) {
+    argv.push_back(arg.data());
+    argvlen.push_back(arg.size());
+  }
+  if (!ac
+      || redisAsyncCommandArgv(ac, onReply, request,
+                               (int)argv.size(), &argv[0], &argvlen[0]) != REDIS_OK)
+    onReply(ac, NULL, request);
+}
+
+int RedisAsyncConnection::run()
+{
+  while (in_flight > 0 && ac && !failed) {
+    struct pollfd fds;
+    fds.fd = ac->c.fd;
+    fds.events = (reading ? POLLIN : 0) | (writing ? POLLOUT : 0);
+    fds.revents = 0;
+    const int ret = poll(&fds, 1, COMMAND_TIMEOUT_SECONDS * 1000);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      LOG(WARNING) << "Timed out waiting for the Redis server";
+      failed = true;
+      break;
+    }
+    if (fds.revents & (POLLIN | POLLERR | POLLHUP))
+      redisAsyncHandleRead(ac);
+    if (ac && (fds.revents & POLLOUT))
+      redisAsyncHandleWrite(ac);
+  }
+
+  if (failed && ac) {
+    redisAsyncContext *dying = ac;
+    ac = NULL;
+    redisAsyncFree(dying);
+  }
+  return (failed || in_flight > 0) ? 1 : 0;
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
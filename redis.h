@@ -1 +1,214 @@
-#include <hiredis/hiredis.h>#include <boost/shared_ptr.hpp>#include <string>void connectRedisServer(redisContext **c, const std::string& host, const int port);bool authenticate(redisContext *c, const std::string& password);typedef boost::shared_ptr<redisReply> redisReplyPtr;void freeRedisReply(redisReply *reply);int checkRedisReply(const redisReplyPtr& reply);
\ No newline at end of file
+#ifndef _GPS_REDIS_H
+#define _GPS_REDIS_H
+
+#include <hiredis/hiredis.h>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
+struct redisAsyncContext; // forward declaration
+
+typedef boost::shared_ptr<redisReply> redisReplyPtr;
+
+void connectRedisServer(redisContext **c, const std::string& host, const int port);
+/**
+ * @return 0 on success, 1 if the connection has been lost or the server
+ * is not ready, -1 if the password is refused
+ */
+int authenticate(redisContext *c, const std::string& password);
+void freeRedisReply(redisReply *reply);
+int checkRedisReply(const redisReplyPtr& reply);
+
+/**
+ * Where to connect, kept to connect again.
+ */
+struct RedisConfig
+{
+  std::string host;
+  int port;
+  std::string password;
+  int retry_seconds; // to keep trying to connect before giving up
+
+  RedisConfig() : host("127.0.0.1"), port(6379), retry_seconds(300) {}
+};
+
+/**
+ * A command with binary-safe arguments.
+ *   RedisCommand("HSET") << key << "board" << board
+ */
+class RedisCommand
+{
+public:
+  explicit RedisCommand(const char *name) { args.push_back(name); }
+
+  RedisCommand& operator<<(const std::string& arg) { args.push_back(arg); return *this; }
+  RedisCommand& operator<<(const char *arg) { args.push_back(arg); return *this; }
+  RedisCommand& operator<<(int arg);
+  RedisCommand& operator<<(size_t arg);
+  RedisCommand& operator<<(long long arg);
+  RedisCommand& operator<<(double arg);
+
+  const std::string& name() const { return args.front(); }
+  const std::vector<std::string>& arguments() const { return args; }
+private:
+  std::vector<std::string> args;
+};
+
+/**
+ * Round trips and their latencies per command name, shared by all the
+ * connections of a process.
+ */
+class RedisStats
+{
+public:
+  static RedisStats& instance();
+
+  /**
+   * @param commands number of commands of the name in a round trip
+   */
+  void record(const std::string& name, size_t commands, double seconds);
+  /**
+   * Commands of all the names recorded so far.
+   */
+  size_t getCommands() const;
+  void write(std::ostream& out) const;
+private:
+  struct Counter
+  {
+    size_t commands, round_trips;
+    double total_seconds, max_seconds;
+    Counter() : commands(0), round_trips(0), total_seconds(0.0), max_seconds(0.0) {}
+  };
+  mutable boost::mutex mutex;
+  std::map<std::string, Counter> counters;
+};
+
+std::ostream& operator<<(std::ostream& out, const RedisStats& stats);
+
+/**
+ * A connection that connects and authenticates again when it is lost,
+ * then sends the commands of the round trip again.  Commands are
+ * therefore expected to be safe to run twice; a position popped twice is
+ * just leased twice and comes back to the queue when the lease expires.
+ * An error reply is fatal, as everywhere in these tools.
+ */
+class RedisConnection
+{
+public:
+  explicit RedisConnection(const RedisConfig& config);
+  ~RedisConnection();
+
+  redisReplyPtr execute(const RedisCommand& command);
+  /**
+   * Send commands in one round trip.
+   */
+  void execute(const std::vector<RedisCommand>& commands,
+               std::vector<redisReplyPtr>& replies);
+
+  /**
+   * Subscribe to a channel, again after reconnections.  The connection
+   * can be used only for waitForMessage() after that.
+   */
+  void subscribe(const std::string& channel);
+  /**
+   * Wait for messages, consuming all of those already received.
+   * @return 0 if any, 1 on timeout
+   */
+  int waitForMessage(int timeout_ms);
+private:
+  RedisConnection(const RedisConnection&);
+  RedisConnection& operator=(const RedisConnection&);
+
+  void connect();
+  /** @return 0 on success, 1 if the connection is lost */
+  int roundTrip(const std::vector<RedisCommand>& commands,
+                std::vector<redisReplyPtr>& replies);
+
+  const RedisConfig config;
+  redisContext *c;
+  std::vector<std::string> channels;
+};
+
+/**
+ * Commands to be sent in one round trip.
+ */
+class RedisPipeline
+{
+public:
+  explicit RedisPipeline(RedisConnection& c) : c(c) {}
+
+  /**
+   * @return the command to add arguments to, valid until the next add()
+   */
+  RedisCommand& add(const char *name)
+  {
+    commands.push_back(RedisCommand(name));
+    return commands.back();
+  }
+  size_t size() const { return commands.size(); }
+  bool empty() const { return commands.empty(); }
+
+  /**
+   * Send the commands and clear them.
+   * @param replies set to the replies of the commands in order
+   */
+  void execute(std::vector<redisReplyPtr>& replies);
+private:
+  RedisConnection& c;
+  std::vector<RedisCommand> commands;
+};
+
+/**
+ * A connection on hiredis's asynchronous context, driven by a local event
+ * loop on poll().  Commands are written as soon as the socket accepts
+ * them and callbacks are called as the replies arrive, so that a caller
+ * can keep round trips in flight while handling replies.  A lost
+ * connection is reported by run(); the owner connects again.
+ */
+class RedisAsyncConnection
+{
+public:
+  /** the reply is NULL if the connection has been lost */
+  typedef boost::function<void (redisReply*)> callback_t;
+
+  /**
+   * Connection errors, including those of connecting, are reported by
+   * run(); a connection is not reused after an error.
+   */
+  explicit RedisAsyncConnection(const RedisConfig& config);
+  ~RedisAsyncConnection();
+
+  void send(const RedisCommand& command, const callback_t& callback);
+  /**
+   * Run the event loop until all the callbacks have been called.
+   * Callbacks may send more commands.
+   * @return 0 on success, 1 if the connection has been lost
+   */
+  int run();
+private:
+  RedisAsyncConnection(const RedisAsyncConnection&);
+  RedisAsyncConnection& operator=(const RedisAsyncConnection&);
+
+  struct Request;
+  static void onReply(redisAsyncContext *ac, void *reply, void *privdata);
+  static void onDisconnect(const redisAsyncContext *ac, int status);
+  static void addRead(void *data);
+  static void delRead(void *data);
+  static void addWrite(void *data);
+  static void delWrite(void *data);
+  static void cleanup(void *data);
+
+  redisAsyncContext *ac;
+  bool reading, writing, failed;
+  size_t in_flight;
+};
+
+#endif /* _GPS_REDIS_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
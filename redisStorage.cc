@@ -0,0 +1,312 @@
+#include "redisStorage.h"
+#include "workQueue.h"
+#include <glog/logging.h>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <boost/shared_ptr.hpp>
+#include <cassert>
+#include <cstdlib>
+#include <ctime>
+
+#include <unistd.h>
+
+namespace
+{
+  /** members returned by SSCAN at a time */
+  const int SCAN_COUNT = 1000;
+
+  const char *positionsKey(osl::Player player)
+  {
+    return player == osl::BLACK ? "tag:black-positions" : "tag:white-positions";
+  }
+
+  /**
+   * A batch of members returned by SSCAN, committed when the depths and
+   * scores of all of them have been read.
+   */
+  struct ScanBatch
+  {
+    std::string cursor; // to continue the scan after this batch
+    std::vector<position_id_t> ids;
+    std::vector<int> depths, scores, settled;
+    size_t remaining;
+
+    ScanBatch() : remaining(0) {}
+  };
+
+  /**
+   * The HMGETs of the members of a batch are sent as soon as SSCAN returns
+   * the batch, followed by the next SSCAN, so that reading a batch and
+   * scanning the next one take a single round trip.  Batches complete in
+   * order; if the connection is lost, scan() resumes from the cursor of the
+   * last batch committed.
+   */
+  class PositionScanner
+  {
+  public:
+    PositionScanner(const std::string& key, const Storage::visitor_t& visit)
+      : key(key), visit(visit), cursor("0"), finished(false), scanned(0)
+    {}
+
+    /**
+     * @return 0 on success, 1 if the connection has been lost
+     */
+    int scan(RedisAsyncConnection& c)
+    {
+      if (finished)
+        return 0;
+      sendScan(c, cursor);
+      return c.run();
+    }
+
+    size_t getScanned() const { return scanned; }
+  private:
+    void sendScan(RedisAsyncConnection& c, const std::string& from)
+    {
+      c.send(RedisCommand("SSCAN") << key << from << "COUNT" << SCAN_COUNT,
+             boost::bind(&PositionScanner::onScan, this, &c, _1));
+    }
+
+    void onScan(RedisAsyncConnection *c, redisReply *reply)
+    {
+      if (!reply)
+        return;
+      assert(reply->type == REDIS_REPLY_ARRAY && reply->elements == 2);
+      boost::shared_ptr<ScanBatch> batch(new ScanBatch);
+      batch->cursor.assign(reply->element[0]->str, reply->element[0]->len);
+      const redisReply *members = reply->element[1];
+      assert(members->type == REDIS_REPLY_ARRAY);
+
+      batch->remaining = members->elements;
+      batch->depths.resize(members->elements, -1);
+      batch->scores.resize(members->elements, 0);
+      batch->settled.resize(members->elements, 0);
+      for (size_t i=0; i<members->elements; ++i) {
+        batch->ids.push_back(memberToPositionId(members->element[i]->str,
+                                                members->element[i]->len));
+        c->send(RedisCommand("HMGET") << positionKey(batch->ids.back())
+                << "depth" << "score" << "result",
+                boost::bind(&PositionScanner::onFields, this, batch, i, _1));
+      }
+      if (batch->ids.empty())
+        commit(*batch);
+      if (batch->cursor != "0")
+        sendScan(*c, batch->cursor);
+    }
+
+    void onFields(boost::shared_ptr<ScanBatch> batch, size_t i, redisReply *fields)
+    {
+      if (!fields)
+        return;
+      assert(fields->type == REDIS_REPLY_ARRAY && fields->elements == 3);
+      const redisReply *d = fields->element[0];
+      const redisReply *v = fields->element[1];
+      const redisReply *result = fields->element[2];
+      if (result->type == REDIS_REPLY_STRING) {
+        bool settled = false;
+        peekSearchResult(result->str, result->len, batch->depths[i], batch->scores[i],
+                         &settled);
+        batch->settled[i] = settled;
+      } else if (d->type == REDIS_REPLY_STRING && v->type == REDIS_REPLY_STRING) {
+        batch->depths[i] = atoi(std::string(d->str, d->len).c_str());
+        batch->scores[i] = atoi(std::string(v->str, v->len).c_str());
+      }
+      if (--batch->remaining == 0)
+        commit(*batch);
+    }
+
+    void commit(const ScanBatch& batch)
+    {
+      for (size_t i=0; i<batch.ids.size(); ++i) {
+        visit(batch.ids[i], batch.depths[i], batch.scores[i], batch.settled[i]);
+      }
+      scanned += batch.ids.size();
+      cursor = batch.cursor;
+      finished = (cursor == "0");
+    }
+
+    const std::string key;
+    const Storage::visitor_t& visit;
+    std::string cursor;
+    bool finished;
+    size_t scanned;
+  };
+} // anonymous namespace
+
+
+RedisStorage::RedisStorage(const RedisConfig& _config)
+  : config(_config), c(_config)
+{
+}
+
+void RedisStorage::reset(osl::Player player, bool canonical)
+{
+  c.execute(RedisCommand("DEL") << positionsKey(player));
+  setCanonicalMode(c, canonical);
+  convertLegacyQueue(c);
+}
+
+bool RedisStorage::isCanonicalMode()
+{
+  return ::isCanonicalMode(c);
+}
+
+/**
+ * The ids of the boards are resolved first, then the positions are sent as
+ * a multi-member ZADD to the queue, a multi-member SADD to the positions
+ * of the player and one HMSET per position.
+ */
+size_t RedisStorage::appendPositions(osl::Player player,
+                                     const std::vector<PositionEntry>& positions,
+                                     int min_depth)
+{
+  if (positions.empty())
+    return 0;
+
+  std::vector<std::string> boards;
+  BOOST_FOREACH(const PositionEntry& position, positions) {
+    boards.push_back(position.board);
+  }
+  std::vector<position_id_t> ids;
+  std::vector<int> depths, settled;
+  if (resolvePositionIds(c, boards, ids, &depths, &settled))
+    exit(1);
+
+  std::vector<size_t> unfinished;
+  for (size_t i=0; i<ids.size(); ++i) {
+    if (min_depth <= 0 || !isSearchedEnough(depths[i], settled[i], min_depth))
+      unfinished.push_back(i);
+  }
+
+  RedisPipeline pipeline(c);
+  size_t commands = 0;
+  if (!unfinished.empty()) {
+    RedisCommand& enqueue = addEnqueueCommand(pipeline);
+    BOOST_FOREACH(const size_t i, unfinished) {
+      enqueue << (boost::format("%.6f") % positions[i].priority).str()
+              << positionIdToMember(ids[i]);
+    }
+    ++commands;
+  }
+  RedisCommand& sadd = pipeline.add("SADD") << positionsKey(player);
+  BOOST_FOREACH(const position_id_t id, ids) {
+    sadd << positionIdToMember(id);
+  }
+  ++commands;
+  for (size_t i=0; i<ids.size(); ++i) {
+    pipeline.add("HMSET") << positionKey(ids[i])
+                          << "moves" << positions[i].moves
+                          << "mirrored" << (int)positions[i].mirrored;
+  }
+  if (!unfinished.empty())
+    pipeline.add("PUBLISH") << NEW_WORK_CHANNEL << unfinished.size();
+
+  /* check results */
+  std::vector<redisReplyPtr> replies;
+  pipeline.execute(replies);
+  for (size_t i=0; i<commands; ++i) {
+    assert(replies[i]->type == REDIS_REPLY_INTEGER);
+    assert(0 <= replies[i]->integer);
+    assert(replies[i]->integer <= (long long)positions.size());
+  }
+  return unfinished.empty() ? 0 : replies[0]->integer;
+}
+
+int RedisStorage::popPositions(long long deadline, size_t count,
+                               std::vector<position_id_t>& ids)
+{
+  return popQueue(c, deadline, count, ids);
+}
+
+int RedisStorage::claimPosition(long long deadline, position_id_t id)
+{
+  return claimQueue(c, deadline, id);
+}
+
+size_t RedisStorage::renewLeases(long long deadline, const std::vector<position_id_t>& ids)
+{
+  return ::renewLeases(c, deadline, ids);
+}
+
+void RedisStorage::releaseLeases(const std::vector<position_id_t>& ids)
+{
+  ::releaseLeases(c, ids);
+}
+
+void RedisStorage::requeueLeases(const std::vector<position_id_t>& ids)
+{
+  ::requeueLeases(c, ids);
+}
+
+int RedisStorage::getQueueLength()
+{
+  return ::getQueueLength(c);
+}
+
+void RedisStorage::subscribeNewWork()
+{
+  if (subscriber)
+    return;
+  subscriber.reset(new RedisConnection(config));
+  ::subscribeNewWork(*subscriber);
+}
+
+int RedisStorage::waitForNewWork(int timeout_ms)
+{
+  assert(subscriber);
+  return ::waitForNewWork(*subscriber, timeout_ms);
+}
+
+void RedisStorage::querySearchResults(std::vector<SearchResult>& results,
+                                      std::vector<int> *found)
+{
+  querySearchResult(c, results, found);
+}
+
+/**
+ * Write the results as binary records, removing the text fields of older
+ * versions and the checkpoints they supersede.
+ */
+void RedisStorage::setResults(const std::vector<SearchResult>& results)
+{
+  RedisPipeline pipeline(c);
+  BOOST_FOREACH(const SearchResult& sr, results) {
+    const std::string key = positionKey(sr.id);
+    pipeline.add("HSET") << key << "result" << encodeSearchResult(sr);
+    pipeline.add("HDEL") << key << "depth" << "score" << "consumed" << "pv" << "timestamp"
+                         << "partial_depth" << "partial_score" << "partial_pv";
+  }
+  std::vector<redisReplyPtr> replies;
+  pipeline.execute(replies);
+}
+
+void RedisStorage::setCheckpoint(position_id_t id, int depth, int score,
+                                 const std::string& pv)
+{
+  c.execute(RedisCommand("HMSET") << positionKey(id)
+            << "partial_depth" << depth << "partial_score" << score
+            << "partial_pv" << pv);
+}
+
+void RedisStorage::scanPositions(osl::Player player, const visitor_t& visit)
+{
+  PositionScanner scanner(positionsKey(player), visit);
+  const time_t give_up = time(NULL) + config.retry_seconds;
+  while (true) {
+    RedisAsyncConnection async(config);
+    if (scanner.scan(async) == 0)
+      break;
+    if (time(NULL) >= give_up) {
+      LOG(FATAL) << "Failed to scan the positions";
+      exit(1);
+    }
+    LOG(WARNING) << "Resuming the scan after " << scanner.getScanned() << " boards";
+    sleep(1);
+  }
+  LOG(INFO) << "Scanned boards: " << scanner.getScanned();
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -0,0 +1,52 @@
+#ifndef _GPS_REDIS_STORAGE_H
+#define _GPS_REDIS_STORAGE_H
+
+#include "redis.h"
+#include "storage.h"
+#include <boost/scoped_ptr.hpp>
+
+/**
+ * Storage in a Redis server along the key schema v2 (see positionKey.h
+ * and workQueue.h).  Commands of a call are sent in one round trip.
+ */
+class RedisStorage : public Storage
+{
+public:
+  explicit RedisStorage(const RedisConfig& config);
+
+  void reset(osl::Player player, bool canonical);
+  bool isCanonicalMode();
+  size_t appendPositions(osl::Player player,
+                         const std::vector<PositionEntry>& positions,
+                         int min_depth);
+
+  int popPositions(long long deadline, size_t count,
+                   std::vector<position_id_t>& ids);
+  int claimPosition(long long deadline, position_id_t id);
+  size_t renewLeases(long long deadline, const std::vector<position_id_t>& ids);
+  void releaseLeases(const std::vector<position_id_t>& ids);
+  void requeueLeases(const std::vector<position_id_t>& ids);
+  int getQueueLength();
+  void subscribeNewWork();
+  int waitForNewWork(int timeout_ms);
+
+  void querySearchResults(std::vector<SearchResult>& results,
+                          std::vector<int> *found=NULL);
+  void setResults(const std::vector<SearchResult>& results);
+  void setCheckpoint(position_id_t id, int depth, int score, const std::string& pv);
+  /**
+   * SSCAN on an asynchronous connection, which never blocks the server for
+   * long.
+   */
+  void scanPositions(osl::Player player, const visitor_t& visit);
+private:
+  const RedisConfig config;
+  RedisConnection c;
+  boost::scoped_ptr<RedisConnection> subscriber; // subscribed to NEW_WORK_CHANNEL
+};
+
+#endif /* _GPS_REDIS_STORAGE_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
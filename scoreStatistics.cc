@@ -0,0 +1,167 @@
+#include "scoreStatistics.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <utility>
+#include <cassert>
+
+QuantileSketch::QuantileSketch(size_t _k)
+  : k(std::max(_k, (size_t)8)), n(0), odd(false), levels(1)
+{
+}
+
+size_t QuantileSketch::capacity(size_t level) const
+{
+  /* lower levels are smaller by the factor of 2/3 */
+  const size_t depth = levels.size() - 1 - level;
+  const double c = k * std::pow(2.0/3.0, (double)depth);
+  return std::max((size_t)std::ceil(c), (size_t)2);
+}
+
+void QuantileSketch::compress()
+{
+  for (size_t h=0; h<levels.size(); ++h) {
+    if (levels[h].size() < capacity(h))
+      continue;
+    if (h+1 == levels.size())
+      levels.push_back(std::vector<double>());
+
+    std::vector<double>& level = levels[h];
+    std::sort(level.begin(), level.end());
+    /* an odd item stays at this level */
+    double rest = 0.0;
+    const bool has_rest = level.size() % 2;
+    if (has_rest) {
+      rest = level.back();
+      level.pop_back();
+    }
+    for (size_t i=(odd ? 1 : 0); i<level.size(); i+=2) {
+      levels[h+1].push_back(level[i]);
+    }
+    odd = !odd;
+    level.clear();
+    if (has_rest)
+      level.push_back(rest);
+  }
+}
+
+void QuantileSketch::add(double value)
+{
+  levels[0].push_back(value);
+  ++n;
+  if (levels[0].size() >= capacity(0))
+    compress();
+}
+
+void QuantileSketch::merge(const QuantileSketch& other)
+{
+  if (levels.size() < other.levels.size())
+    levels.resize(other.levels.size());
+  for (size_t h=0; h<other.levels.size(); ++h) {
+    levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+  }
+  n += other.n;
+  compress();
+}
+
+double QuantileSketch::quantile(double q) const
+{
+  assert(0.0 <= q && q <= 1.0);
+  std::vector<std::pair<double, double> > items; // value and weight
+  double total = 0.0;
+  for (size_t h=0; h<levels.size(); ++h) {
+    const double weight = std::ldexp(1.0, (int)h);
+    for (size_t i=0; i<levels[h].size(); ++i) {
+      items.push_back(std::make_pair(levels[h][i], weight));
+      total += weight;
+    }
+  }
+  if (items.empty())
+    return std::numeric_limits<double>::quiet_NaN();
+
+  std::sort(items.begin(), items.end());
+  const double target = q * total;
+  double sum = 0.0;
+  for (size_t i=0; i<items.size(); ++i) {
+    sum += items[i].second;
+    if (sum >= target)
+      return items[i].first;
+  }
+  return items.back().first;
+}
+
+
+ScoreStatistics::ScoreStatistics(int _bin_width)
+  : bin_width(std::max(_bin_width, 1)), n(0), m(0.0), m2(0.0),
+    min(std::numeric_limits<double>::max()),
+    max(-std::numeric_limits<double>::max())
+{
+}
+
+void ScoreStatistics::add(double score)
+{
+  ++n;
+  const double delta = score - m;
+  m += delta / n;
+  m2 += delta * (score - m);
+  min = std::min(min, score);
+  max = std::max(max, score);
+  ++bins[(long)std::floor(score / bin_width)];
+  sketch.add(score);
+}
+
+void ScoreStatistics::merge(const ScoreStatistics& other)
+{
+  assert(bin_width == other.bin_width);
+  if (other.n == 0)
+    return;
+  /* Chan et al. */
+  const double total = (double)n + other.n;
+  const double delta = other.m - m;
+  m2 += other.m2 + delta * delta * n * other.n / total;
+  m += delta * other.n / total;
+  n += other.n;
+  min = std::min(min, other.min);
+  max = std::max(max, other.max);
+  for (std::map<long, size_t>::const_iterator each = other.bins.begin();
+       each != other.bins.end(); ++each) {
+    bins[each->first] += each->second;
+  }
+  sketch.merge(other.sketch);
+}
+
+void ScoreStatistics::write(std::ostream& out) const
+{
+  out << "count:   " << n << "\n";
+  if (n == 0)
+    return;
+
+  out << std::fixed << std::setprecision(1)
+      << "min:     " << min << "\n"
+      << "1st qu.: " << quantile(0.25) << "\n"
+      << "median:  " << quantile(0.5) << "\n"
+      << "mean:    " << mean() << "\n"
+      << "3rd qu.: " << quantile(0.75) << "\n"
+      << "max:     " << max << "\n"
+      << "sd:      " << std::sqrt(variance()) << "\n";
+
+  out << "deciles:";
+  for (int i=1; i<10; ++i) {
+    out << " " << quantile(i / 10.0);
+  }
+  out << "\n";
+
+  out << "bins (width " << bin_width << "):\n";
+  for (std::map<long, size_t>::const_iterator each = bins.begin();
+       each != bins.end(); ++each) {
+    out << std::setw(8) << each->first * bin_width
+        << std::setw(8) << (each->first + 1) * bin_width
+        << std::setw(10) << each->second << "\n";
+  }
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
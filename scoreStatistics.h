@@ -0,0 +1,73 @@
+#ifndef _GPS_SCORE_STATISTICS_H
+#define _GPS_SCORE_STATISTICS_H
+
+#include <iosfwd>
+#include <map>
+#include <vector>
+#include <cstddef>
+
+/**
+ * A mergeable sketch of quantiles in the manner of KLL.  Values are kept
+ * in levels of compactors; an item of level h stands for 2^h values.  A
+ * full level is sorted and every other item of it is promoted, so that
+ * the memory is O(k log(n/k)) and the error of ranks is O(n/k).
+ */
+class QuantileSketch
+{
+public:
+  explicit QuantileSketch(size_t k=1000);
+
+  void add(double value);
+  void merge(const QuantileSketch& other);
+
+  size_t count() const { return n; }
+  /**
+   * @param q 0 <= q <= 1
+   */
+  double quantile(double q) const;
+private:
+  size_t capacity(size_t level) const;
+  void compress();
+
+  size_t k;
+  size_t n;
+  bool odd; // alternates the items promoted
+  std::vector<std::vector<double> > levels;
+};
+
+/**
+ * Statistics of scores computed in one pass: count, mean and variance by
+ * Welford's method, min and max, fixed-width bins and quantiles.  Two
+ * statistics of the same bin width can be merged.
+ */
+class ScoreStatistics
+{
+public:
+  explicit ScoreStatistics(int bin_width=50);
+
+  void add(double score);
+  void merge(const ScoreStatistics& other);
+
+  size_t count() const { return n; }
+  double mean() const { return m; }
+  double variance() const { return n > 1 ? m2 / (n - 1) : 0.0; }
+  double quantile(double q) const { return sketch.quantile(q); }
+
+  /**
+   * Write a summary like summary() of R, the deciles and the bins.
+   */
+  void write(std::ostream& out) const;
+private:
+  int bin_width;
+  size_t n;
+  double m, m2;
+  double min, max;
+  std::map<long, size_t> bins; // floor(score / bin_width) => count
+  QuantileSketch sketch;
+};
+
+#endif /* _GPS_SCORE_STATISTICS_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
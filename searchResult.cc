@@ -8,6 +8,7 @@
 #include <glog/logging.h>
 #include <iostream>
 #include <sstream>
+#include <cstring>
 #include <ctime>
 
 const std::string
@@ -23,34 +24,198 @@ SearchResult::toString() const
 {
   std::ostringstream out;
   out << ":depth "      << depth <<
+         (settled ? " :settled" : "") <<
          " :score "     << score <<
          " :consumed "  << consumed_seconds <<
-         " :pv "        << pv <<
+         " :pv "        << pvString() <<
          " :timestamp " << timestamp <<
          " :moves " << movesToCsaString(moves)
          << std::endl;
   return out.str();
 }
 
+const std::string
+SearchResult::pvString() const
+{
+  if (!pv_moves.empty())
+    return movesToCsaString(pv_moves);
+  return pv;
+}
+
 const std::string compactBoardToString(const osl::record::CompactBoard& cb)
 {
-  std::ostringstream ss;
-  ss << cb;
-  return ss.str();
+  std::string ret(COMPACT_BOARD_SIZE, '\0');
+  encodeCompactBoard(cb, &ret[0]);
+  return ret;
+}
+
+uint64_t compactBoardHash(const std::string& key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i=0; i<key.size(); ++i) {
+    hash ^= static_cast<unsigned char>(key[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+const std::string canonicalBoardString(const osl::SimpleState& state, bool& mirrored)
+{
+  const std::string key = compactBoardToString(osl::record::CompactBoard(state));
+  const std::string mirror =
+    compactBoardToString(osl::record::CompactBoard(state.flipHorizontal()));
+  mirrored = mirror < key;
+  return mirrored ? mirror : key;
+}
+
+const std::string mirrorCsaMoves(const std::string& moves)
+{
+  std::string ret(moves);
+  for (size_t i=0; i+6<ret.size(); ++i) {
+    if (ret[i] != '+' && ret[i] != '-')
+      continue;
+    /* files of the from and to squares; 0 for drops */
+    for (size_t j=i+1; j<=i+3; j+=2) {
+      if ('1' <= ret[j] && ret[j] <= '9')
+        ret[j] = '0' + 10 - (ret[j] - '0');
+    }
+    i += 6;
+  }
+  return ret;
+}
+
+void unmirrorSearchResult(SearchResult& sr)
+{
+  if (!sr.mirrored)
+    return;
+  sr.board = osl::record::CompactBoard(sr.board.getState().flipHorizontal());
+  BOOST_FOREACH(osl::Move& move, sr.pv_moves) {
+    move = move.flipHorizontal();
+  }
+  sr.pv = mirrorCsaMoves(sr.pv);
+  sr.partial_pv = mirrorCsaMoves(sr.partial_pv);
+  sr.mirrored = false;
 }
 
 
-void readMoves(const std::string& binary, moves_t& moves)
+
+namespace
+{
+  void appendInt32(std::string& out, uint32_t value)
+  {
+    for (int shift=24; shift>=0; shift-=8) {
+      out.push_back(static_cast<char>((value >> shift) & 0xff));
+    }
+  }
+
+  void appendInt64(std::string& out, uint64_t value)
+  {
+    appendInt32(out, static_cast<uint32_t>(value >> 32));
+    appendInt32(out, static_cast<uint32_t>(value));
+  }
+
+  uint32_t readInt32(const char *p)
+  {
+    const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+  }
+
+  uint64_t readInt64(const char *p)
+  {
+    return (uint64_t)readInt32(p) << 32 | readInt32(p+4);
+  }
+} // anonymous namespace
+
+const std::string encodeSearchResult(const SearchResult& sr)
+{
+  const bool csa = sr.pv_moves.empty() && !sr.pv.empty();
+  std::string out;
+  out.reserve(SEARCH_RESULT_HEADER_SIZE + (csa ? sr.pv.size() : sr.pv_moves.size()*4));
+  out.push_back(static_cast<char>(csa ? 1 : SEARCH_RESULT_VERSION));
+  out.push_back(static_cast<char>(sr.settled ? SEARCH_RESULT_SETTLED : 0));
+  out.append(2, '\0');
+  appendInt32(out, sr.depth);
+  appendInt32(out, sr.score);
+  appendInt32(out, sr.consumed_seconds);
+  appendInt64(out, sr.timestamp);
+  if (csa) {
+    appendInt32(out, sr.pv.size());
+    out.append(sr.pv);
+  } else {
+    appendInt32(out, sr.pv_moves.size());
+    BOOST_FOREACH(const osl::Move move, sr.pv_moves) {
+      appendInt32(out, move.intValue());
+    }
+  }
+  return out;
+}
+
+int peekSearchResult(const char *data, size_t len, int& depth, int& score,
+                     bool *settled)
 {
-  std::stringstream ss(binary);
-  const int size = binary.size() / 4 /* 4 bytes per move */;
+  if (len < SEARCH_RESULT_HEADER_SIZE)
+    return 1;
+  const uint8_t version = static_cast<uint8_t>(data[0]);
+  if (version != 1 && version != 2)
+    return 1;
+  depth = static_cast<int32_t>(readInt32(data+4));
+  score = static_cast<int32_t>(readInt32(data+8));
+  if (settled)
+    *settled = data[1] & SEARCH_RESULT_SETTLED;
+  return 0;
+}
 
-  for (int i=0; i<size; ++i) {
-    const int i = osl::record::readInt(ss);
-    moves.push_back(osl::Move::makeDirect(i));
+int decodeSearchResult(const char *data, size_t len, SearchResult& sr)
+{
+  if (peekSearchResult(data, len, sr.depth, sr.score, &sr.settled))
+    return 1;
+  sr.consumed_seconds = static_cast<int32_t>(readInt32(data+12));
+  sr.timestamp = static_cast<time_t>(static_cast<int64_t>(readInt64(data+16)));
+  const uint32_t size = readInt32(data+24);
+  const char *p = data + SEARCH_RESULT_HEADER_SIZE;
+  if (data[0] == 1) {
+    if (len != SEARCH_RESULT_HEADER_SIZE + size)
+      return 1;
+    sr.pv.assign(p, size);
+    return 0;
   }
+  if (len != SEARCH_RESULT_HEADER_SIZE + (size_t)size*4)
+    return 1;
+  sr.pv_moves.clear();
+  sr.pv_moves.reserve(size);
+  for (uint32_t i=0; i<size; ++i, p+=4) {
+    sr.pv_moves.push_back(osl::Move::makeDirect(static_cast<int32_t>(readInt32(p))));
+  }
+  return 0;
+}
+
+void csaStringToMoves(const std::string& csa, const osl::SimpleState& src, moves_t& moves)
+{
+  osl::NumEffectState state(src);
+  for (size_t i=0; i<csa.size(); ++i) {
+    if (csa[i] == '+' || csa[i] == '-' || csa[i] == '%') {
+      for (size_t j=i+1; true; ++j) {
+        if (j == csa.size() || csa[j] == '+' || csa[j] == '-' || csa[j] == '%') {
+          const osl::Move move = osl::record::csa::strToMove(csa.substr(i,(j-i)), state);
+          moves.push_back(move);
+          state.makeMove(move);
+          i = j-1;
+          break;
+        }
+      } // for j
+    }
+  } // for i
 }
 
+namespace
+{
+  bool isField(const redisReply *field, const char *name)
+  {
+    const size_t len = strlen(name);
+    return field->len == len && memcmp(field->str, name, len) == 0;
+  }
+} // anonymous namespace
+
 int parseSearchResultReply(const redisReplyPtr reply, SearchResult& sr)
 {
   if (checkRedisReply(reply))
@@ -63,40 +228,68 @@ int parseSearchResultReply(const redisReplyPtr reply, SearchResult& sr)
   }
 
   for(size_t i=0; i<reply->elements; /*empty*/) {
-    const redisReply *r = reply->element[i++];
-    assert(r->type == REDIS_REPLY_STRING);
-    const std::string field(r->str, r->len);
-    if ("depth" == field) {
+    const redisReply *field = reply->element[i++];
+    assert(field->type == REDIS_REPLY_STRING);
+    if (isField(field, "result")) {
+      const redisReply *r = reply->element[i++];
+      assert(r->type == REDIS_REPLY_STRING);
+      if (decodeSearchResult(r->str, r->len, sr))
+        LOG(WARNING) << "broken search result: " << sr.id;
+    } else if (isField(field, "depth")) {
       const redisReply *r = reply->element[i++];
       assert(r->type == REDIS_REPLY_STRING);
       const std::string str(r->str, r->len);
       sr.depth = boost::lexical_cast<int>(str);
-    } else if ("score" == field) {
+    } else if (isField(field, "score")) {
       const redisReply *r = reply->element[i++];
       assert(r->type == REDIS_REPLY_STRING);
       const std::string str(r->str, r->len);
       sr.score = boost::lexical_cast<int>(str);
-    } else if ("consumed" == field) {
+    } else if (isField(field, "consumed")) {
       const redisReply *r = reply->element[i++];
       assert(r->type == REDIS_REPLY_STRING);
       const std::string str(r->str, r->len);
       sr.consumed_seconds = boost::lexical_cast<int>(str);
-    } else if ("pv" == field) {
+    } else if (isField(field, "pv")) {
       const redisReply *r = reply->element[i++];
       assert(r->type == REDIS_REPLY_STRING);
       sr.pv.assign(r->str, r->len);
-    } else if ("timestamp" == field) {
+    } else if (isField(field, "timestamp")) {
       const redisReply *r = reply->element[i++];
       assert(r->type == REDIS_REPLY_STRING);
       const std::string str(r->str, r->len);
       sr.timestamp = boost::lexical_cast<int>(str);
-    } else if ("moves" == field) {
+    } else if (isField(field, "board")) {
+      const redisReply *r = reply->element[i++];
+      assert(r->type == REDIS_REPLY_STRING);
+      if (decodeCompactBoard(r->str, r->len, sr.board))
+        LOG(WARNING) << "broken board: " << sr.id;
+    } else if (isField(field, "partial_depth")) {
       const redisReply *r = reply->element[i++];
       assert(r->type == REDIS_REPLY_STRING);
       const std::string str(r->str, r->len);
-      readMoves(str, sr.moves);
+      sr.partial_depth = boost::lexical_cast<int>(str);
+    } else if (isField(field, "partial_score")) {
+      const redisReply *r = reply->element[i++];
+      assert(r->type == REDIS_REPLY_STRING);
+      const std::string str(r->str, r->len);
+      sr.partial_score = boost::lexical_cast<int>(str);
+    } else if (isField(field, "partial_pv")) {
+      const redisReply *r = reply->element[i++];
+      assert(r->type == REDIS_REPLY_STRING);
+      sr.partial_pv.assign(r->str, r->len);
+    } else if (isField(field, "mirrored")) {
+      const redisReply *r = reply->element[i++];
+      assert(r->type == REDIS_REPLY_STRING);
+      const std::string str(r->str, r->len);
+      sr.mirrored = boost::lexical_cast<int>(str) != 0;
+    } else if (isField(field, "moves")) {
+      const redisReply *r = reply->element[i++];
+      assert(r->type == REDIS_REPLY_STRING);
+      decodeMoves(r->str, r->len, sr.moves);
     } else {
-      LOG(WARNING) << "unknown field found: " << field;
+      LOG(WARNING) << "unknown field found: " << std::string(field->str, field->len);
+      ++i; // skip the value
     }
   }
 
@@ -104,28 +297,27 @@ int parseSearchResultReply(const redisReplyPtr reply, SearchResult& sr)
 }
 
 
-int querySearchResult(redisContext *c, SearchResult& sr)
+int querySearchResult(RedisConnection& c, SearchResult& sr)
 {
-  const std::string key = compactBoardToString(sr.board);
-  redisReplyPtr reply((redisReply*)redisCommand(c, "HGETALL %b", key.c_str(), key.size()),
-                      freeRedisReply);
-  parseSearchResultReply(reply, sr);
-
-  return 0;
+  return parseSearchResultReply(c.execute(RedisCommand("HGETALL") << positionKey(sr.id)), sr);
 }
 
-int querySearchResult(redisContext *c, std::vector<SearchResult>& results)
+int querySearchResult(RedisConnection& c, std::vector<SearchResult>& results,
+                      std::vector<int> *found)
 {
+  if (found)
+    found->assign(results.size(), 0);
+  RedisPipeline pipeline(c);
   BOOST_FOREACH(const SearchResult& sr, results) {
-    const std::string key = compactBoardToString(sr.board);
-    redisAppendCommand(c, "HGETALL %b", key.c_str(), key.size());
+    pipeline.add("HGETALL") << positionKey(sr.id);
   }
+  std::vector<redisReplyPtr> replies;
+  pipeline.execute(replies);
 
-  BOOST_FOREACH(SearchResult& sr, results) {
-    void *r;
-    redisGetReply(c, &r);
-    redisReplyPtr reply((redisReply*)r, freeRedisReply);
-    parseSearchResultReply(reply, sr);
+  for (size_t i=0; i<results.size(); ++i) {
+    const int ret = parseSearchResultReply(replies[i], results[i]);
+    if (found)
+      (*found)[i] = (ret == 0);
   }
   
   return 0;
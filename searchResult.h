@@ -1,29 +1,46 @@
 #ifndef _GPS_SEARCH_RESULT_H
 #define _GPS_SEARCH_RESULT_H
 
+#include "boardCodec.h"
+#include "positionKey.h"
 #include "osl/record/compactBoard.h"
+#include <boost/shared_ptr.hpp>
 #include <functional>
 #include <vector>
 #include <string>
-
-typedef osl::stl::vector<osl::Move> moves_t;
+#include <stdint.h>
 
 struct SearchResult {
+  position_id_t id;
   osl::record::CompactBoard board;
   int depth;
   int score;            // evaluation value
   int consumed_seconds; // actual seconds consumed by thinking.
   time_t timestamp;     // current time stamp as seconds from Epoch.
-  std::string pv;
+  moves_t pv_moves;     // principal variation
+  std::string pv;       // principal variation in CSA, of older records
   moves_t moves;
+  /** the deepest iteration completed by an unfinished search */
+  int partial_depth;
+  int partial_score;
+  std::string partial_pv;
+  /** the moves lead to the mirror of the board (see canonicalBoardString()) */
+  bool mirrored;
+  /** the time manager stopped the search at depth as its result had settled */
+  bool settled;
 
-  explicit SearchResult(const osl::record::CompactBoard& _board)
-    : board(_board),
-      depth(0), score(0), consumed_seconds(0), timestamp(time(NULL))
+  explicit SearchResult(position_id_t _id)
+    : id(_id),
+      depth(0), score(0), consumed_seconds(0), timestamp(time(NULL)),
+      partial_depth(0), partial_score(0), mirrored(false), settled(false)
   {}
 
   const std::string timeString() const;
   const std::string toString() const;
+  /**
+   * The principal variation in CSA.
+   */
+  const std::string pvString() const;
 };
 
 struct SearchResultCompare : public std::binary_function<SearchResult, SearchResult, bool> {
@@ -32,16 +49,112 @@ struct SearchResultCompare : public std::binary_function<SearchResult, SearchRes
   }
 };
 
-struct redisContext; // forward declaration
+class RedisConnection; // forward declaration
+struct redisReply;
+
+/**
+ * Whether a result needs no deeper search for the target depth: it has
+ * reached the depth, or the time manager stopped it short as settled.
+ */
+inline bool isSearchedEnough(int result_depth, bool settled, int target_depth)
+{
+  return settled || result_depth >= target_depth;
+}
 
 const std::string compactBoardToString(const osl::record::CompactBoard& cb);
 
-int querySearchResult(redisContext *c, SearchResult& sr);
+/**
+ * 64-bit FNV-1a hash of a string made by compactBoardToString().
+ */
+uint64_t compactBoardHash(const std::string& key);
+
+/**
+ * The smaller of the strings of a state and its horizontal mirror.  As the
+ * rules are symmetric, a position and its mirror share a search result if
+ * positions are keyed by this string.
+ * @param mirrored set to true if the string is of the mirror
+ */
+const std::string canonicalBoardString(const osl::SimpleState& state, bool& mirrored);
+
+/**
+ * Parse moves of CSA format, replaying them from state.
+ */
+void csaStringToMoves(const std::string& csa, const osl::SimpleState& state, moves_t& moves);
+
+/**
+ * Mirror moves of CSA format horizontally.
+ * ex. +7776FU-3334FU to +3334FU-7776FU
+ */
+const std::string mirrorCsaMoves(const std::string& moves);
+
+/**
+ * Turn the board and the principal variations of a result of a mirrored
+ * position back to the position reached by its moves.
+ */
+void unmirrorSearchResult(SearchResult& sr);
+
+/**
+ * A search result is stored in the field "result" of the hash of the
+ * position as a binary record.  Integers are in big endian.
+ *   version 2:
+ *     uint8   version
+ *     uint8   flags (SEARCH_RESULT_SETTLED)
+ *     uint8   reserved[2]
+ *     int32   depth
+ *     int32   score
+ *     int32   consumed_seconds
+ *     int64   timestamp
+ *     uint32  number of moves of the principal variation
+ *     int32[] principal variation (osl::Move::intValue())
+ *   version 1:
+ *     the same as version 2 but the principal variation is a CSA string
+ *     preceded by its size
+ * Older versions stored each member in its own text field, which are
+ * still read.
+ */
+const uint8_t SEARCH_RESULT_VERSION = 2;
+const size_t SEARCH_RESULT_HEADER_SIZE = 28;
+/** flag of SearchResult::settled */
+const uint8_t SEARCH_RESULT_SETTLED = 1;
+
+/**
+ * Results having only a CSA principal variation, e.g. those promoted from
+ * checkpoints, are encoded in version 1.
+ */
+const std::string encodeSearchResult(const SearchResult& sr);
+
+/**
+ * Decode a record in place, without intermediate strings.
+ * @return 0 on success, 1 if the record is broken or of an unknown version
+ */
+int decodeSearchResult(const char *data, size_t len, SearchResult& sr);
+
+/**
+ * Decode only the depth and score of a record.
+ * @param settled if not NULL, set to SearchResult::settled
+ * @return 0 on success
+ */
+int peekSearchResult(const char *data, size_t len, int& depth, int& score,
+                     bool *settled=NULL);
+
+/**
+ * Read a reply of HGETALL of the hash of a position into sr.
+ * @return 0 on success, 1 if the reply is empty
+ */
+int parseSearchResultReply(const boost::shared_ptr<redisReply> reply, SearchResult& sr);
+
+/**
+ * Read the hash of sr.id, including the board.
+ * @return 0 on success, 1 if the position is not found
+ */
+int querySearchResult(RedisConnection& c, SearchResult& sr);
 
 /**
  * Pipelined version.
+ * @param found if not NULL, set to 1 for positions found and 0 otherwise
  */
-int querySearchResult(redisContext *c, std::vector<SearchResult>& results);
+int querySearchResult(RedisConnection& c, std::vector<SearchResult>& results,
+                      std::vector<int> *found=NULL);
 
 /**
  * Convert moves into a string of CSA format.
@@ -0,0 +1,451 @@
+#include "bookIndex.h"
+#include "bookTraversal.h"
+#include "fakeSearch.h"
+#include "localStorage.h"
+#include "redis.h"
+#include "searchResult.h"
+#include "storage.h"
+#include "syntheticBook.h"
+#include "workQueue.h"
+#include "osl/state/numEffectState.h"
+#include <glog/logging.h>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include <signal.h>
+#include <sys/time.h>
+
+/**
+ * Simulates master, clients and histogram on a synthetic book with fake
+ * searches (see fakeSearch()), to find where the queue and the storage
+ * stop scaling with the number of clients without paying for searches.
+ * For each number of workers, the book is traversed into the storage as
+ * master does, the workers search the positions as client does, and the
+ * results are scanned as histogram does.  The storage is local unless
+ * --redis is given, and each worker opens its own as a client thread.
+ * Reported are the positions searched per second against the ideal, the
+ * storage operations per second, the percentiles of the latencies of each
+ * operation, and signs of contention: pops finding every queued position
+ * leased by others, and waits for the locks of the local storage.
+ */
+
+/**
+ * Global variables
+ */
+
+namespace bp = boost::program_options;
+bp::variables_map vm;
+
+std::string workers_str = "1,4,16,64,256";
+int prefetch = 1;
+int lease_seconds = 120;
+size_t batch_size = 1000;
+unsigned int seed = 1;
+std::string format = "text";
+std::string book_file = "simulate.dat";
+SyntheticBookConfig book_config;
+FakeSearchConfig fake_search;
+bool use_redis = false;
+StorageConfig storage_config;
+
+const volatile sig_atomic_t never_stop = 0;
+
+/**
+ * Operations timed by the workers
+ */
+enum Operation {
+  OPEN, POP, QUERY, SET_RESULTS, RELEASE, QUEUE_LENGTH, WAIT, OPERATIONS
+};
+const char *operation_names[OPERATIONS] = {
+  "open", "pop", "query", "setResults", "release", "queueLength", "wait"
+};
+
+/**
+ * Functions
+ */
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/**
+ * Appends positions as master's PositionWriter does.
+ */
+class StorageSink : public PositionSink
+{
+public:
+  explicit StorageSink(Storage& storage) : storage(storage), queued(0) {}
+  ~StorageSink() { flush(); }
+
+  void append(const std::string& state_key, const moves_t& moves, double reach) {
+    PositionEntry position;
+    position.board = state_key;
+    position.moves = encodeMoves(moves);
+    position.priority = queuePriority(moves.size() + 1, reach);
+    positions.push_back(position);
+    if (positions.size() >= batch_size)
+      flush();
+  }
+
+  void flush() {
+    if (positions.empty())
+      return;
+    queued += storage.appendPositions(osl::BLACK, positions, 0);
+    positions.clear();
+  }
+
+  size_t getQueued() const { return queued; }
+private:
+  Storage& storage;
+  size_t queued;
+  std::vector<PositionEntry> positions;
+};
+
+/**
+ * Searches positions as a thread of client does, timing each operation
+ * of the storage, until the queue is empty.
+ */
+class SimulatedWorker
+{
+public:
+  explicit SimulatedWorker(unsigned int _seed)
+    : seed(_seed), searched(0), empty_pops(0)
+  {}
+
+  void run();
+
+  std::vector<double> latencies[OPERATIONS]; // seconds
+  unsigned int seed;
+  size_t searched, empty_pops;
+};
+
+void SimulatedWorker::run()
+{
+  double start = now();
+  boost::shared_ptr<Storage> storage = openStorage(storage_config);
+  storage->subscribeNewWork();
+  /* client's Worker keeps a second storage for its LeaseKeeper */
+  boost::shared_ptr<Storage> heartbeat = openStorage(storage_config);
+  latencies[OPEN].push_back(now() - start);
+
+  std::vector<position_id_t> ids;
+  while (true) {
+    start = now();
+    const int empty = storage->popPositions(leaseDeadline(lease_seconds), prefetch, ids);
+    latencies[POP].push_back(now() - start);
+    if (empty) {
+      start = now();
+      const int queue_length = storage->getQueueLength();
+      latencies[QUEUE_LENGTH].push_back(now() - start);
+      if (queue_length == 0)
+        break;
+      /* the rest are leased by other workers */
+      ++empty_pops;
+      start = now();
+      storage->waitForNewWork(10);
+      latencies[WAIT].push_back(now() - start);
+      continue;
+    }
+
+    std::vector<SearchResult> results;
+    BOOST_FOREACH(const position_id_t id, ids) {
+      results.push_back(SearchResult(id));
+    }
+    std::vector<int> found;
+    start = now();
+    storage->querySearchResults(results, &found);
+    latencies[QUERY].push_back(now() - start);
+
+    std::vector<SearchResult> searched_results;
+    for (size_t i=0; i<results.size(); ++i) {
+      if (!found[i])
+        continue;
+      SearchResult& sr = results[i];
+      sr.depth = 1;
+      moves_t pv;
+      fakeSearch(fake_search, osl::NumEffectState(sr.board.getState()), sr, pv,
+                 seed, never_stop);
+      sr.timestamp = time(NULL);
+      searched_results.push_back(sr);
+    }
+
+    start = now();
+    storage->setResults(searched_results);
+    latencies[SET_RESULTS].push_back(now() - start);
+    start = now();
+    storage->releaseLeases(ids);
+    latencies[RELEASE].push_back(now() - start);
+    searched += searched_results.size();
+  }
+}
+
+void countSearched(size_t *scanned, size_t *searched,
+                   position_id_t /*id*/, int depth, int /*score*/, bool /*settled*/)
+{
+  ++*scanned;
+  if (depth > 0)
+    ++*searched;
+}
+
+double percentile(const std::vector<double>& sorted, double q)
+{
+  if (sorted.empty())
+    return 0.0;
+  return sorted[std::min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+}
+
+/**
+ * Metrics of a number of workers, in text or in rows of
+ * workers, metric and value.
+ */
+class Report
+{
+public:
+  explicit Report(int _workers) : workers(_workers) {}
+
+  void add(const std::string& name, double value) {
+    names.push_back(name);
+    values.push_back(value);
+  }
+  void write(std::ostream& out, bool tsv) const;
+private:
+  const int workers;
+  std::vector<std::string> names;
+  std::vector<double> values;
+};
+
+void Report::write(std::ostream& out, bool tsv) const
+{
+  if (!tsv)
+    out << "Workers: " << workers << "\n";
+  for (size_t i=0; i<names.size(); ++i) {
+    if (tsv)
+      out << boost::format("%d\t%s\t%.6g\n") % workers % names[i] % values[i];
+    else
+      out << boost::format("  %-28s %14.2f\n") % names[i] % values[i];
+  }
+  out << std::flush;
+}
+
+/**
+ * Run master, the workers and histogram once.
+ */
+void simulate(BookSource& book, int workers, bool tsv)
+{
+  boost::shared_ptr<Storage> storage = openStorage(storage_config);
+
+  /* master */
+  double start = now();
+  storage->reset(osl::BLACK, false);
+  size_t queued;
+  {
+    StorageSink sink(*storage);
+    traverseBook(book, TraversalConfig(), sink);
+    sink.flush();
+    queued = sink.getQueued();
+  }
+  const double master_seconds = now() - start;
+
+  /* clients */
+  const size_t redis_commands = RedisStats::instance().getCommands();
+  const uint64_t lock_waits = LocalStorage::getLockWaits();
+  std::vector<boost::shared_ptr<SimulatedWorker> > simulated;
+  boost::thread_group threads;
+  start = now();
+  for (int i=0; i<workers; ++i) {
+    simulated.push_back(boost::shared_ptr<SimulatedWorker>(new SimulatedWorker(seed + i)));
+    threads.create_thread(boost::bind(&SimulatedWorker::run, simulated.back().get()));
+  }
+  threads.join_all();
+  const double client_seconds = now() - start;
+
+  /* histogram */
+  size_t scanned = 0, scanned_searched = 0;
+  start = now();
+  storage->scanPositions(osl::BLACK, boost::bind(&countSearched, &scanned, &scanned_searched,
+                                                 _1, _2, _3, _4));
+  const double histogram_seconds = now() - start;
+
+  size_t searched = 0, empty_pops = 0, operations = 0;
+  std::vector<double> latencies[OPERATIONS];
+  BOOST_FOREACH(const boost::shared_ptr<SimulatedWorker>& worker, simulated) {
+    searched   += worker->searched;
+    empty_pops += worker->empty_pops;
+    for (int i=0; i<OPERATIONS; ++i) {
+      latencies[i].insert(latencies[i].end(),
+                          worker->latencies[i].begin(), worker->latencies[i].end());
+    }
+  }
+  if (searched != queued || scanned_searched != scanned)
+    LOG(WARNING) << "Queued " << queued << " positions, searched " << searched
+                 << ", " << scanned_searched << " of " << scanned << " found searched";
+
+  Report report(workers);
+  report.add("queued", queued);
+  report.add("searched", searched);
+  report.add("master_seconds", master_seconds);
+  report.add("client_seconds", client_seconds);
+  report.add("histogram_seconds", histogram_seconds);
+  report.add("positions_per_second", searched / client_seconds);
+  if (fake_search.latency_ms > 0) {
+    /* every worker always searching */
+    const double ideal = workers * 1000.0 / fake_search.latency_ms;
+    report.add("efficiency", searched / client_seconds / ideal);
+  }
+  for (int i=0; i<OPERATIONS; ++i)
+    operations += latencies[i].size();
+  report.add("storage_ops_per_second", operations / client_seconds);
+  if (use_redis)
+    report.add("redis_commands_per_second",
+               (RedisStats::instance().getCommands() - redis_commands) / client_seconds);
+  else
+    report.add("lock_waits", LocalStorage::getLockWaits() - lock_waits);
+  report.add("empty_pops", empty_pops);
+  for (int i=0; i<OPERATIONS; ++i) {
+    std::vector<double>& sorted = latencies[i];
+    if (sorted.empty())
+      continue;
+    std::sort(sorted.begin(), sorted.end());
+    const std::string name = operation_names[i];
+    report.add(name + ".count",   sorted.size());
+    report.add(name + ".p50_us",  percentile(sorted, 0.5)   * 1e6);
+    report.add(name + ".p99_us",  percentile(sorted, 0.99)  * 1e6);
+    report.add(name + ".p999_us", percentile(sorted, 0.999) * 1e6);
+    report.add(name + ".max_us",  sorted.back() * 1e6);
+  }
+  report.write(std::cout, tsv);
+}
+
+void printUsage(std::ostream& out,
+                char **argv,
+                const boost::program_options::options_description& command_line_options)
+{
+  out <<
+    "Usage: " << argv[0] << " [options]\n"
+      << command_line_options
+      << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  /* Set up logging */
+  FLAGS_log_dir = ".";
+  google::InitGoogleLogging(argv[0]);
+
+  std::string local_dir = "simulate.d";
+  fake_search.latency_ms = 5;
+  book_config.states = 4000;
+
+  /* Parse command line options */
+  bp::options_description command_line_options;
+  command_line_options.add_options()
+    ("workers", bp::value<std::string>(&workers_str)->default_value(workers_str),
+     "numbers of workers to simulate, separated by commas")
+    ("latency-ms", bp::value<int>(&fake_search.latency_ms)->default_value(fake_search.latency_ms),
+     "mean milliseconds of a fake search")
+    ("latency-spread", bp::value<double>(&fake_search.spread)->default_value(fake_search.spread),
+     "fake searches take --latency-ms times 1 +/- this fraction")
+    ("prefetch", bp::value<int>(&prefetch)->default_value(prefetch),
+     "number of positions popped at a time")
+    ("lease-seconds", bp::value<int>(&lease_seconds)->default_value(lease_seconds),
+     "seconds before a position of a dead worker is requeued")
+    ("batch-size", bp::value<size_t>(&batch_size)->default_value(batch_size),
+     "number of positions appended at a time by master")
+    ("book-file", bp::value<std::string>(&book_file)->default_value(book_file),
+     "file to write the synthetic book to.  its index is written to <book-file>.idx")
+    ("book-states", bp::value<int>(&book_config.states)->default_value(book_config.states),
+     "states of the synthetic book")
+    ("book-branching", bp::value<int>(&book_config.branching)->default_value(book_config.branching),
+     "moves from a state of the synthetic book at most")
+    ("seed", bp::value<unsigned int>(&seed)->default_value(seed),
+     "seed of the synthetic book and of the fake searches")
+    ("local-storage", bp::value<std::string>(&local_dir)->default_value(local_dir),
+     "directory of the local storage")
+    ("local-capacity", bp::value<size_t>(&storage_config.local_capacity)->default_value(storage_config.local_capacity),
+     "positions that a new local storage can hold")
+    ("redis", bp::bool_switch(&use_redis),
+     "use the redis server instead of the local storage.  its positions of black are replaced")
+    ("redis-host", bp::value<std::string>(&storage_config.redis.host)->default_value(storage_config.redis.host),
+     "IP of the redis server")
+    ("redis-password", bp::value<std::string>(&storage_config.redis.password)->default_value(storage_config.redis.password),
+     "password to connect to the redis server")
+    ("redis-port", bp::value<int>(&storage_config.redis.port)->default_value(storage_config.redis.port),
+     "port number of the redis server")
+    ("format", bp::value<std::string>(&format)->default_value(format),
+     "text, or tsv to compare runs")
+    ("help,h", "show this help message.");
+  bp::positional_options_description p;
+
+  try {
+    bp::store(
+      bp::command_line_parser(
+	argc, argv).options(command_line_options).positional(p).run(), vm);
+    bp::notify(vm);
+    if (vm.count("help")) {
+      printUsage(std::cout, argv, command_line_options);
+      return 0;
+    }
+  } catch (std::exception &e) {
+    std::cerr << "error in parsing options\n"
+	      << e.what() << std::endl;
+    printUsage(std::cerr, argv, command_line_options);
+    return 1;
+  }
+
+  std::vector<int> workers;
+  {
+    std::istringstream in(workers_str);
+    std::string each;
+    while (std::getline(in, each, ','))
+      if (atoi(each.c_str()) > 0)
+        workers.push_back(atoi(each.c_str()));
+  }
+  if (workers.empty() || (format != "text" && format != "tsv")) {
+    printUsage(std::cerr, argv, command_line_options);
+    return 1;
+  }
+  prefetch = std::max(prefetch, 1);
+  book_config.seed = seed;
+  if (!use_redis)
+    storage_config.local_dir = local_dir;
+
+  /* Make the book */
+  const std::string index_file = book_file + ".idx";
+  BookIndex book;
+  if (writeSyntheticBook(book_file, book_config)
+      || buildBookIndex(book_file, index_file)
+      || book.open(index_file, book_file)) {
+    std::cerr << "Failed to prepare the book " << book_file << std::endl;
+    return 1;
+  }
+
+  const bool tsv = (format == "tsv");
+  if (tsv) {
+    std::cout << boost::format("# latency-ms=%d latency-spread=%g prefetch=%d book-states=%d"
+                               " book-branching=%d seed=%u storage=%s\n")
+      % fake_search.latency_ms % fake_search.spread % prefetch
+      % book_config.states % book_config.branching % seed % (use_redis ? "redis" : "local");
+    std::cout << "workers\tmetric\tvalue" << std::endl;
+  }
+  BOOST_FOREACH(const int n, workers) {
+    simulate(book, n, tsv);
+  }
+  return 0;
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -0,0 +1,22 @@
+#include "storage.h"
+#include "localStorage.h"
+#include "redisStorage.h"
+#include <glog/logging.h>
+
+boost::shared_ptr<Storage> openStorage(const StorageConfig& config)
+{
+  if (!config.local_dir.empty())
+    return boost::shared_ptr<Storage>(new LocalStorage(config.local_dir,
+                                                       config.local_capacity));
+  return boost::shared_ptr<Storage>(new RedisStorage(config.redis));
+}
+
+void logStorageStats(const StorageConfig& config)
+{
+  if (config.local_dir.empty())
+    LOG(INFO) << "Redis commands:\n" << RedisStats::instance();
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -0,0 +1,137 @@
+#ifndef _GPS_STORAGE_H
+#define _GPS_STORAGE_H
+
+#include "positionKey.h"
+#include "redis.h"
+#include "searchResult.h"
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <vector>
+
+/**
+ * A position registered by master.
+ */
+struct PositionEntry
+{
+  std::string board;  // made by compactBoardToString(), canonical in the canonical mode
+  std::string moves;  // made by encodeMoves()
+  bool mirrored;
+  double priority;    // made by queuePriority()
+
+  PositionEntry() : mirrored(false), priority(0.0) {}
+};
+
+/**
+ * Where the positions, the work queue and the search results are kept.
+ * RedisStorage keeps them in a Redis server shared by hosts, and
+ * LocalStorage in files shared by the processes of a host.  An instance
+ * is used by one thread at a time; open one per thread.
+ * The work queue leases positions as described in workQueue.h.
+ */
+class Storage
+{
+public:
+  virtual ~Storage() {}
+
+  /**
+   * Called by master before appending positions.  Forget the positions of
+   * the player and set the canonical mode.
+   */
+  virtual void reset(osl::Player player, bool canonical) = 0;
+  /**
+   * Whether positions are keyed by the canonical boards.
+   */
+  virtual bool isCanonicalMode() = 0;
+  /**
+   * Register positions of the player and queue those whose results are
+   * missing or not searched enough for min_depth (see isSearchedEnough()),
+   * or all if min_depth <= 0.  Those
+   * leased to clients are left alone.  Idle clients are notified.
+   * @return the number of positions queued
+   */
+  virtual size_t appendPositions(osl::Player player,
+                                 const std::vector<PositionEntry>& positions,
+                                 int min_depth) = 0;
+
+  /**
+   * @return 0 on success, 1 if the queue is empty
+   */
+  virtual int popPositions(long long deadline, size_t count,
+                           std::vector<position_id_t>& ids) = 0;
+  /**
+   * @return 0 on success, 1 if the position is not in the queue
+   */
+  virtual int claimPosition(long long deadline, position_id_t id) = 0;
+  /**
+   * @return the number of leases that have been lost
+   */
+  virtual size_t renewLeases(long long deadline,
+                             const std::vector<position_id_t>& ids) = 0;
+  virtual void releaseLeases(const std::vector<position_id_t>& ids) = 0;
+  virtual void requeueLeases(const std::vector<position_id_t>& ids) = 0;
+  /**
+   * Number of positions queued or leased.
+   */
+  virtual int getQueueLength() = 0;
+  /**
+   * Start receiving the notifications of appendPositions().
+   */
+  virtual void subscribeNewWork() = 0;
+  /**
+   * @return 0 if notified, 1 on timeout
+   */
+  virtual int waitForNewWork(int timeout_ms) = 0;
+
+  /**
+   * Read the results of the ids of results, including the boards.
+   * @param found if not NULL, set to 1 for positions found and 0 otherwise
+   */
+  virtual void querySearchResults(std::vector<SearchResult>& results,
+                                  std::vector<int> *found=NULL) = 0;
+  /**
+   * Write results, removing the checkpoints they supersede.
+   */
+  virtual void setResults(const std::vector<SearchResult>& results) = 0;
+  /**
+   * Save the last iteration completed by an unfinished search.
+   * @param pv in CSA
+   */
+  virtual void setCheckpoint(position_id_t id, int depth, int score,
+                             const std::string& pv) = 0;
+
+  /**
+   * id, depth (-1 if not searched), score and SearchResult::settled of a
+   * position
+   */
+  typedef boost::function<void (position_id_t, int, int, bool)> visitor_t;
+  /**
+   * Visit the positions of the player.  A position may be visited more
+   * than once.
+   */
+  virtual void scanPositions(osl::Player player, const visitor_t& visit) = 0;
+};
+
+struct StorageConfig
+{
+  RedisConfig redis;
+  /** if not empty, positions are kept in the directory instead of Redis */
+  std::string local_dir;
+  /** positions that a new local storage can hold */
+  size_t local_capacity;
+
+  StorageConfig() : local_capacity(1 << 20) {}
+};
+
+boost::shared_ptr<Storage> openStorage(const StorageConfig& config);
+/**
+ * Log the statistics of the backend of the config, which are kept for all
+ * the storages of the process.  Only the Redis backend has any.
+ */
+void logStorageStats(const StorageConfig& config);
+
+#endif /* _GPS_STORAGE_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
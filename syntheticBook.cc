@@ -0,0 +1,130 @@
+#include "syntheticBook.h"
+#include "boardCodec.h"
+#include "searchResult.h"
+#include "osl/move_generator/legalMoves.h"
+#include "osl/record/compactBoard.h"
+#include "osl/record/record.h"
+#include "osl/state/numEffectState.h"
+#include <glog/logging.h>
+#include <boost/foreach.hpp>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <cstdlib>
+#include <stdint.h>
+
+namespace
+{
+  const int WEIGHTED_BOOK_VERSION = 1;
+
+  struct Edge
+  {
+    int move;
+    int next_state;
+    int weight;
+
+    Edge(int _move, int _next_state, int _weight)
+      : move(_move), next_state(_next_state), weight(_weight)
+    {}
+  };
+
+  bool heavier(const Edge& lhs, const Edge& rhs)
+  {
+    return lhs.weight > rhs.weight;
+  }
+} // anonymous namespace
+
+int writeSyntheticBook(const std::string& file_name, const SyntheticBookConfig& config)
+{
+  unsigned int seed = config.seed;
+  const size_t max_states = std::max(config.states, 1);
+
+  // boards in the order of the states, expanded in this order as well
+  std::vector<std::string> boards;
+  std::map<uint64_t, int> state_of_hash;
+  std::vector<Edge> edges;
+  std::vector<int> first_edges;
+
+  const osl::SimpleState initial(osl::HIRATE);
+  boards.push_back(compactBoardToString(osl::record::CompactBoard(initial)));
+  state_of_hash[compactBoardHash(boards.back())] = 0;
+
+  for (size_t i=0; i<boards.size(); ++i) {
+    first_edges.push_back(edges.size());
+    if (boards.size() >= max_states)
+      continue;               // leaves once the book is full
+
+    osl::SimpleState board;
+    if (decodeCompactBoard(boards[i].data(), boards[i].size(), board))
+      LOG(FATAL) << "broken board";
+    const osl::NumEffectState state(board);
+    osl::MoveVector moves;
+    osl::LegalMoves::generate(state, moves);
+
+    const size_t first = edges.size();
+    const size_t n = std::min((size_t)std::max(config.branching, 0), (size_t)moves.size());
+    for (size_t j=0; j<n; ++j) {
+      // pick distinct moves by a partial shuffle
+      std::swap(moves[j], moves[j + rand_r(&seed) % (moves.size() - j)]);
+      osl::NumEffectState next(state);
+      next.makeMove(moves[j]);
+      const std::string key = compactBoardToString(osl::record::CompactBoard(next));
+      const uint64_t hash = compactBoardHash(key);
+
+      std::map<uint64_t, int>::const_iterator found = state_of_hash.find(hash);
+      int next_state;
+      if (found != state_of_hash.end()) {
+        next_state = found->second;
+      } else if (boards.size() < max_states) {
+        next_state = boards.size();
+        boards.push_back(key);
+        state_of_hash[hash] = next_state;
+      } else {
+        continue;
+      }
+      // about one move in ten is not recommended
+      const int weight = rand_r(&seed) % 10 ? rand_r(&seed) % 1000 + 1 : 0;
+      edges.push_back(Edge(moves[j].intValue(), next_state, weight));
+    }
+    std::sort(edges.begin() + first, edges.end(), heavier);
+  }
+  first_edges.push_back(edges.size());
+
+  std::ofstream out(file_name.c_str(), std::ios_base::binary | std::ios_base::trunc);
+  if (!out) {
+    LOG(ERROR) << "Failed to open " << file_name;
+    return 1;
+  }
+  osl::record::writeInt(out, WEIGHTED_BOOK_VERSION);
+  osl::record::writeInt(out, boards.size());
+  osl::record::writeInt(out, edges.size());
+  osl::record::writeInt(out, 0);
+  for (size_t i=0; i<boards.size(); ++i) {
+    osl::record::writeInt(out, first_edges[i]);
+    osl::record::writeInt(out, first_edges[i+1] - first_edges[i]);
+    osl::record::writeInt(out, 0);
+    osl::record::writeInt(out, 0);
+  }
+  BOOST_FOREACH(const Edge& edge, edges) {
+    osl::record::writeInt(out, edge.move);
+    osl::record::writeInt(out, edge.next_state);
+    osl::record::writeInt(out, edge.weight);
+  }
+  BOOST_FOREACH(const std::string& board, boards) {
+    out.write(board.data(), board.size());
+  }
+  out.close();
+  if (!out) {
+    LOG(ERROR) << "Failed to write " << file_name;
+    return 1;
+  }
+
+  LOG(INFO) << "Wrote a book of " << boards.size() << " states and "
+            << edges.size() << " moves";
+  return 0;
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
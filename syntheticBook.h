@@ -0,0 +1,36 @@
+#ifndef _GPS_SYNTHETIC_BOOK_H
+#define _GPS_SYNTHETIC_BOOK_H
+
+#include <string>
+
+struct SyntheticBookConfig
+{
+  int states;         // states of the book
+  int branching;      // moves from a state at most
+  unsigned int seed;  // the same seed makes the same book
+
+  SyntheticBookConfig()
+    : states(100000), branching(4), seed(1)
+  {}
+};
+
+/**
+ * Write a WeightedBook of random legal moves from the initial position, to
+ * measure master and buildIndex without a real book.  States are expanded
+ * level by level until the book has config.states states; a move reaching
+ * a board already in the book becomes a transposition.  Weights are random
+ * and some are 0.
+ * The file has the layout read by osl::record::opening::WeightedBook:
+ *   int32  version (1), number of states, number of moves, start state
+ *   per state: int32 first move, number of moves, black wins, white wins
+ *   per move:  int32 move (osl::Move::intValue()), next state, weight
+ *   per state: CompactBoard
+ * @return 0 on success
+ */
+int writeSyntheticBook(const std::string& file_name, const SyntheticBookConfig& config);
+
+#endif /* _GPS_SYNTHETIC_BOOK_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
@@ -0,0 +1,231 @@
+#include "workQueue.h"
+#include "redis.h"
+#include <hiredis/hiredis.h>
+#include <glog/logging.h>
+#include <boost/foreach.hpp>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+
+#include <sys/time.h>
+
+const char *const QUEUE_KEY = "tag:new-queue";
+const char *const LEASES_KEY = "tag:leases";
+const char *const LEASE_SCORES_KEY = "tag:lease-scores";
+const char *const NEW_WORK_CHANNEL = "tag:new-work";
+
+double queuePriority(int depth, double reach)
+{
+  assert(0.0 < reach && reach <= 1.0);
+  // bits of information to reach the position, then the depth
+  return -std::log(reach) / std::log(2.0) + depth * 1e-3;
+}
+
+long long leaseDeadline(int lease_seconds)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (long long)now.tv_sec*1000 + now.tv_usec/1000 + (long long)lease_seconds*1000;
+}
+
+namespace
+{
+  /** expired leases requeued per pop */
+  const int REAP_LIMIT = 16;
+
+  /**
+   * KEYS: queue, leases, lease scores
+   * ARGV: now, deadline, reap limit, count
+   */
+  const char *const POP_SCRIPT =
+    "local expired = redis.call('ZRANGEBYSCORE', KEYS[2], '-inf', ARGV[1], 'LIMIT', 0, ARGV[3])\n"
+    "for i, member in ipairs(expired) do\n"
+    "  local score = redis.call('HGET', KEYS[3], member) or 0\n"
+    "  redis.call('ZREM', KEYS[2], member)\n"
+    "  redis.call('HDEL', KEYS[3], member)\n"
+    "  redis.call('ZADD', KEYS[1], score, member)\n"
+    "end\n"
+    "local head = redis.call('ZRANGE', KEYS[1], 0, ARGV[4] - 1, 'WITHSCORES')\n"
+    "local members = {}\n"
+    "for i = 1, #head, 2 do\n"
+    "  redis.call('ZREM', KEYS[1], head[i])\n"
+    "  redis.call('ZADD', KEYS[2], ARGV[2], head[i])\n"
+    "  redis.call('HSET', KEYS[3], head[i], head[i+1])\n"
+    "  members[#members+1] = head[i]\n"
+    "end\n"
+    "return members\n";
+
+  /**
+   * KEYS: queue, leases, lease scores
+   * ARGV: member, deadline
+   */
+  const char *const CLAIM_SCRIPT =
+    "local score = redis.call('ZSCORE', KEYS[1], ARGV[1])\n"
+    "if not score then return 0 end\n"
+    "redis.call('ZREM', KEYS[1], ARGV[1])\n"
+    "redis.call('ZADD', KEYS[2], ARGV[2], ARGV[1])\n"
+    "redis.call('HSET', KEYS[3], ARGV[1], score)\n"
+    "return 1\n";
+
+  /**
+   * KEYS: leases
+   * ARGV: member, deadline
+   */
+  const char *const RENEW_SCRIPT =
+    "if not redis.call('ZSCORE', KEYS[1], ARGV[1]) then return 0 end\n"
+    "redis.call('ZADD', KEYS[1], ARGV[2], ARGV[1])\n"
+    "return 1\n";
+
+  /**
+   * KEYS: leases, lease scores
+   * ARGV: member
+   */
+  const char *const RELEASE_SCRIPT =
+    "redis.call('ZREM', KEYS[1], ARGV[1])\n"
+    "redis.call('HDEL', KEYS[2], ARGV[1])\n"
+    "return 1\n";
+
+  /**
+   * KEYS: queue, leases, lease scores
+   * ARGV: member
+   */
+  const char *const REQUEUE_SCRIPT =
+    "local score = redis.call('HGET', KEYS[3], ARGV[1]) or 0\n"
+    "if redis.call('ZREM', KEYS[2], ARGV[1]) == 0 then return 0 end\n"
+    "redis.call('HDEL', KEYS[3], ARGV[1])\n"
+    "redis.call('ZADD', KEYS[1], score, ARGV[1])\n"
+    "return 1\n";
+
+  /**
+   * KEYS: queue, leases
+   * ARGV: pairs of a score and a member
+   */
+  const char *const ENQUEUE_SCRIPT =
+    "local queued = 0\n"
+    "for i = 1, #ARGV, 2 do\n"
+    "  if not redis.call('ZSCORE', KEYS[2], ARGV[i+1]) then\n"
+    "    redis.call('ZADD', KEYS[1], ARGV[i], ARGV[i+1])\n"
+    "    queued = queued + 1\n"
+    "  end\n"
+    "end\n"
+    "return queued\n";
+} // anonymous namespace
+
+RedisCommand& addEnqueueCommand(RedisPipeline& pipeline)
+{
+  return pipeline.add("EVAL") << ENQUEUE_SCRIPT << 2 << QUEUE_KEY << LEASES_KEY;
+}
+
+int popQueue(RedisConnection& c, long long deadline, size_t count,
+             std::vector<position_id_t>& ids)
+{
+  const long long now = leaseDeadline(0);
+  redisReplyPtr reply = c.execute(RedisCommand("EVAL") << POP_SCRIPT << 3
+                                  << QUEUE_KEY << LEASES_KEY << LEASE_SCORES_KEY
+                                  << now << deadline << REAP_LIMIT << count);
+  assert(reply->type == REDIS_REPLY_ARRAY);
+  ids.clear();
+  for (size_t i=0; i<reply->elements; ++i) {
+    const redisReply *member = reply->element[i];
+    assert(member->type == REDIS_REPLY_STRING);
+    ids.push_back(memberToPositionId(member->str, member->len));
+  }
+  return ids.empty() ? 1 : 0;
+}
+
+int claimQueue(RedisConnection& c, long long deadline, position_id_t id)
+{
+  redisReplyPtr reply = c.execute(RedisCommand("EVAL") << CLAIM_SCRIPT << 3
+                                  << QUEUE_KEY << LEASES_KEY << LEASE_SCORES_KEY
+                                  << positionIdToMember(id) << deadline);
+  assert(reply->type == REDIS_REPLY_INTEGER);
+  return reply->integer == 1 ? 0 : 1;
+}
+
+size_t renewLeases(RedisConnection& c, long long deadline,
+                   const std::vector<position_id_t>& ids)
+{
+  RedisPipeline pipeline(c);
+  BOOST_FOREACH(const position_id_t id, ids) {
+    pipeline.add("EVAL") << RENEW_SCRIPT << 1 << LEASES_KEY
+                         << positionIdToMember(id) << deadline;
+  }
+  std::vector<redisReplyPtr> replies;
+  pipeline.execute(replies);
+
+  size_t lost = 0;
+  for (size_t i=0; i<replies.size(); ++i) {
+    assert(replies[i]->type == REDIS_REPLY_INTEGER);
+    if (replies[i]->integer != 1) {
+      LOG(WARNING) << "Lost the lease: " << ids[i];
+      ++lost;
+    }
+  }
+  return lost;
+}
+
+void releaseLeases(RedisConnection& c, const std::vector<position_id_t>& ids)
+{
+  RedisPipeline pipeline(c);
+  BOOST_FOREACH(const position_id_t id, ids) {
+    pipeline.add("EVAL") << RELEASE_SCRIPT << 2 << LEASES_KEY << LEASE_SCORES_KEY
+                         << positionIdToMember(id);
+  }
+  std::vector<redisReplyPtr> replies;
+  pipeline.execute(replies);
+}
+
+void requeueLeases(RedisConnection& c, const std::vector<position_id_t>& ids)
+{
+  RedisPipeline pipeline(c);
+  BOOST_FOREACH(const position_id_t id, ids) {
+    pipeline.add("EVAL") << REQUEUE_SCRIPT << 3
+                         << QUEUE_KEY << LEASES_KEY << LEASE_SCORES_KEY
+                         << positionIdToMember(id);
+  }
+  std::vector<redisReplyPtr> replies;
+  pipeline.execute(replies);
+}
+
+int getQueueLength(RedisConnection& c)
+{
+  RedisPipeline pipeline(c);
+  pipeline.add("ZCARD") << QUEUE_KEY;
+  pipeline.add("ZCARD") << LEASES_KEY;
+  std::vector<redisReplyPtr> replies;
+  pipeline.execute(replies);
+
+  int length = 0;
+  BOOST_FOREACH(const redisReplyPtr& reply, replies) {
+    assert(reply->type == REDIS_REPLY_INTEGER);
+    length += reply->integer;
+  }
+  return length;
+}
+
+void subscribeNewWork(RedisConnection& c)
+{
+  c.subscribe(NEW_WORK_CHANNEL);
+}
+
+int waitForNewWork(RedisConnection& c, int timeout_ms)
+{
+  return c.waitForMessage(timeout_ms);
+}
+
+void convertLegacyQueue(RedisConnection& c)
+{
+  redisReplyPtr type = c.execute(RedisCommand("TYPE") << QUEUE_KEY);
+  assert(type->type == REDIS_REPLY_STATUS);
+  if (std::string(type->str) != "set")
+    return;
+
+  LOG(INFO) << "Converting " << QUEUE_KEY << " to a sorted set";
+  const std::string tmp_key = std::string(QUEUE_KEY) + ":converting";
+  c.execute(RedisCommand("ZUNIONSTORE") << tmp_key << 1 << QUEUE_KEY << "WEIGHTS" << 0);
+  c.execute(RedisCommand("RENAME") << tmp_key << QUEUE_KEY);
+}
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End:
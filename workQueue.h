@@ -0,0 +1,109 @@
+#ifndef _GPS_WORK_QUEUE_H
+#define _GPS_WORK_QUEUE_H
+
+#include "positionKey.h"
+#include <vector>
+
+/**
+ * Positions to be searched are kept in tag:new-queue, a sorted set of ids
+ * (see positionKey.h).  Positions with lower scores are searched first.
+ *
+ * A position taken out of the queue is leased to a client until a
+ * deadline, recorded in tag:leases, a sorted set of ids scored by the
+ * deadlines in milliseconds from Epoch.  The score the position had in the
+ * queue is kept in the hash tag:lease-scores.  The client renews the lease
+ * while searching and releases it when the result is written.  Expired
+ * leases are put back to the queue by the next pop.
+ */
+extern const char *const QUEUE_KEY;
+extern const char *const LEASES_KEY;
+extern const char *const LEASE_SCORES_KEY;
+
+/**
+ * master publishes the number of positions queued to this channel, so that
+ * idle clients do not have to poll the queue.
+ */
+extern const char *const NEW_WORK_CHANNEL;
+
+/**
+ * Score of a position in the queue.  Positions that are likely to be
+ * reached following the book come first, and shallower ones among them.
+ * @param reach probability of reaching the position, 0 < reach <= 1
+ */
+double queuePriority(int depth, double reach);
+
+/**
+ * Deadline of a lease that starts now, in milliseconds from Epoch.
+ */
+long long leaseDeadline(int lease_seconds);
+
+class RedisCommand; // forward declaration
+class RedisConnection;
+class RedisPipeline;
+
+/**
+ * Add to the pipeline a command that queues positions, or updates their
+ * scores, unless they are leased; a position being searched is not
+ * searched again by another client.  Pairs of a score and
+ * positionIdToMember() are to be added to the command.  The reply is the
+ * number of positions queued.
+ */
+RedisCommand& addEnqueueCommand(RedisPipeline& pipeline);
+
+/**
+ * Requeue expired leases, then pop at most count positions with the lowest
+ * scores and lease them until the deadline.
+ * @return 0 on success, 1 if the queue is empty
+ */
+int popQueue(RedisConnection& c, long long deadline, size_t count,
+             std::vector<position_id_t>& ids);
+
+/**
+ * Take a particular position out of the queue and lease it.
+ * @return 0 on success, 1 if the position is not in the queue
+ */
+int claimQueue(RedisConnection& c, long long deadline, position_id_t id);
+
+/**
+ * Extend leases.
+ * @return the number of leases that have been lost
+ */
+size_t renewLeases(RedisConnection& c, long long deadline,
+                   const std::vector<position_id_t>& ids);
+
+void releaseLeases(RedisConnection& c, const std::vector<position_id_t>& ids);
+
+/**
+ * Give leased positions back to the queue with their original scores.
+ */
+void requeueLeases(RedisConnection& c, const std::vector<position_id_t>& ids);
+
+/**
+ * Number of positions queued or leased.
+ */
+int getQueueLength(RedisConnection& c);
+
+/**
+ * Subscribe a connection to NEW_WORK_CHANNEL.  The connection can be used
+ * only for waitForNewWork() after that.
+ */
+void subscribeNewWork(RedisConnection& c);
+
+/**
+ * Wait for notifications of new positions, consuming all of those already
+ * received.
+ * @return 0 if notified, 1 on timeout
+ */
+int waitForNewWork(RedisConnection& c, int timeout_ms);
+
+/**
+ * Older versions kept the queue as a set.  Convert it to a sorted set,
+ * giving the same score to all the positions in it.
+ */
+void convertLegacyQueue(RedisConnection& c);
+
+#endif /* _GPS_WORK_QUEUE_H */
+// ;;; Local Variables:
+// ;;; mode:c++
+// ;;; c-basic-offset:2
+// ;;; End: